@@ -3,6 +3,7 @@
 #include "console.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -10,6 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -21,19 +26,41 @@
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
+
+/*
+ * Commands and parameters are also kept in open addressing hash tables, so
+ * that looking one up by name takes about one string comparison however
+ * many there are.  The lists keep the alphabetical order for help.
+ */
+typedef struct {
+    char **names; /* Key of each slot, NULL if empty */
+    void **eles;  /* List element of each slot */
+    size_t size;  /* Number of slots, a power of 2 */
+    size_t count; /* Number of slots in use */
+} name_table_t;
+
+#define NAME_TABLE_MIN 64
+
+static name_table_t cmd_table;
+static name_table_t param_table;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
 /* Am I timing a command that has the console blocked? */
 static bool block_timing = false;
 
-/* Time of day */
-static double first_time;
-static double last_time;
+/* Start of the session and of the last timed interval, in ns */
+static uint64_t first_time;
+static uint64_t last_time;
+
+/* Time with the cycle counter instead of the clock */
+static int tsc_timing = 0;
 
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped into memory instead, and the mapping serves as
+ * a buffer holding the whole file.
  */
 
 #define RIO_BUFSIZE 8192
@@ -41,8 +68,10 @@ typedef struct RIO_ELE rio_t, *rio_ptr;
 
 struct RIO_ELE {
     int fd;                /* File descriptor */
-    int cnt;               /* Unread bytes in internal buffer */
+    ssize_t cnt;           /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Mapping of the file, NULL if read() is used */
+    size_t map_size;       /* Length of the mapping */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     rio_ptr prev;          /* Next element in stack */
 };
@@ -62,6 +91,26 @@ static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
+/* Record the latency of every command run, see do_stats */
+static int cmd_stats = 0;
+
+/*
+ * Latency histogram of a command, in nanoseconds.  Values below
+ * LATENCY_SUB are counted exactly.  Above, every power of 2 is split into
+ * LATENCY_SUB buckets of equal width, so a bucket is within 1/LATENCY_SUB
+ * of any value it holds, up to the largest 64-bit value.
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((65 - LATENCY_SUB_BITS) * LATENCY_SUB)
+
+struct LATENCY {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
 
@@ -70,11 +119,78 @@ static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
 static void init_in();
+bool cmd_done();
 
 static bool push_file(char *fname);
 static void pop_file();
 
-static bool interpret_cmda(int argc, char *argv[]);
+/* FNV-1a hash of a string */
+static uint32_t hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding name, or the empty slot where it belongs */
+static size_t table_slot(const name_table_t *t, const char *name)
+{
+    size_t mask = t->size - 1;
+    size_t i = hash_name(name) & mask;
+    while (t->names[i] && strcmp(t->names[i], name) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void table_clear(name_table_t *t)
+{
+    if (t->size) {
+        free_array(t->names, t->size, sizeof(char *));
+        free_array(t->eles, t->size, sizeof(void *));
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+static void table_put(name_table_t *t, char *name, void *ele);
+
+/* Move the entries to a table with size slots */
+static void table_resize(name_table_t *t, size_t size)
+{
+    name_table_t old = *t;
+    t->names = calloc_or_fail(size, sizeof(char *), "table_resize");
+    t->eles = calloc_or_fail(size, sizeof(void *), "table_resize");
+    t->size = size;
+    t->count = 0;
+    for (size_t i = 0; i < old.size; i++) {
+        if (old.names[i])
+            table_put(t, old.names[i], old.eles[i]);
+    }
+    table_clear(&old);
+}
+
+/* Map name to ele, replacing any earlier entry for name */
+static void table_put(name_table_t *t, char *name, void *ele)
+{
+    /* Keep at least half of the slots empty so probe runs stay short */
+    if (2 * (t->count + 1) > t->size)
+        table_resize(t, t->size ? 2 * t->size : NAME_TABLE_MIN);
+    size_t i = table_slot(t, name);
+    if (!t->names[i])
+        t->count++;
+    t->names[i] = name;
+    t->eles[i] = ele;
+}
+
+/* Return the element name maps to, or NULL */
+static void *table_get(const name_table_t *t, const char *name)
+{
+    if (!t->size)
+        return NULL;
+    return t->eles[table_slot(t, name)];
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
@@ -90,8 +206,10 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->latency = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+    table_put(&cmd_table, name, ele);
 }
 
 /* Add a new parameter */
@@ -114,25 +232,67 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    table_put(&param_table, name, ele);
+}
+
+/* Length of a command line, which ends at a newline or a null character */
+static size_t line_length(const char *line)
+{
+    return strcspn(line, "\n");
 }
 
-/* Parse a string into a command line */
+/* Storage for the words of a command line, kept between commands so that
+ * parsing one does not allocate
+ */
+static char *arg_buf = NULL;
+static size_t arg_buf_size = 0;
+static char **arg_vec = NULL;
+static size_t arg_vec_size = 0;
+
+static void free_args()
+{
+    if (arg_buf)
+        free_block(arg_buf, arg_buf_size);
+    if (arg_vec)
+        free_array(arg_vec, arg_vec_size, sizeof(char *));
+    arg_buf = NULL;
+    arg_vec = NULL;
+    arg_buf_size = arg_vec_size = 0;
+}
+
+/* Make room for a line of len characters and its words */
+static void reserve_args(size_t len)
+{
+    if (len + 1 <= arg_buf_size)
+        return;
+
+    size_t size = arg_buf_size ? arg_buf_size : 128;
+    while (size < len + 1)
+        size *= 2;
+    free_args();
+    arg_buf = malloc_or_fail(size, "parse_args");
+    arg_buf_size = size;
+    /* Every word takes at least one character and a separator */
+    arg_vec_size = size / 2 + 1;
+    arg_vec = calloc_or_fail(arg_vec_size, sizeof(char *), "parse_args");
+}
+
+/*
+ * Parse a string into a command line.  The words are copied, each
+ * null-terminated, into storage owned by the console, which stays valid
+ * until the next line is parsed.  The line itself is left untouched.
+ */
 static char **parse_args(char *line, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    size_t len = line_length(line);
+    reserve_args(len);
     char *src = line;
-    char *dst = buf;
+    char *dst = arg_buf;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    for (char *end = line + len; src < end;) {
+        c = *src++;
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -142,24 +302,16 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                arg_vec[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    *dst = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return arg_vec;
 }
 
 static void record_error()
@@ -171,18 +323,55 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static size_t latency_bucket(uint64_t ns)
+{
+    if (ns < LATENCY_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return (size_t) shift * LATENCY_SUB + (ns >> shift);
+}
+
+/* Largest value counted in bucket i */
+static uint64_t latency_bucket_max(size_t i)
+{
+    if (i < 2 * LATENCY_SUB)
+        return i;
+    int shift = i / LATENCY_SUB - 1;
+    uint64_t top = i - (uint64_t) shift * LATENCY_SUB;
+    return ((top + 1) << shift) - 1;
+}
+
+/* Run cmd, recording its latency when asked to */
+static bool run_cmd(cmd_ptr cmd, int argc, char *argv[])
+{
+    if (!cmd_stats)
+        return cmd->operation(argc, argv);
+
+    uint64_t start = time_ns();
+    bool ok = cmd->operation(argc, argv);
+    uint64_t ns = time_ns() - start;
+
+    /* The command may have been freed by quit */
+    if (quit_flag)
+        return ok;
+    if (!cmd->latency)
+        cmd->latency =
+            calloc_or_fail(1, sizeof(struct LATENCY), "latency histogram");
+    struct LATENCY *lat = cmd->latency;
+    lat->count++;
+    lat->sum += ns;
+    if (ns > lat->max)
+        lat->max = ns;
+    lat->buckets[latency_bucket(ns)]++;
+    return ok;
+}
+
+/* Run command cmd, already looked up for argv[0], or NULL if none */
+static bool execute_cmd(cmd_ptr cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        ok = run_cmd(cmd, argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -191,9 +380,19 @@ static bool interpret_cmda(int argc, char *argv[])
         ok = false;
     }
 
+    report_flush();
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return execute_cmd(table_get(&cmd_table, argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -201,16 +400,12 @@ static bool interpret_cmd(char *cmdline)
         return false;
 
 #if RPT >= 6
-    report(6, "Interpreting command '%s'\n", cmdline);
+    report(6, "Interpreting command '%.*s'\n", (int) line_length(cmdline),
+           cmdline);
 #endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -236,6 +431,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(struct LATENCY));
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -245,6 +442,10 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    table_clear(&cmd_table);
+    table_clear(&param_table);
 
     while (buf_stack)
         pop_file();
@@ -252,6 +453,8 @@ static bool do_quit(int argc, char *argv[])
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
+    /* argv may have been parsed into this, so only free it now */
+    free_args();
 
     quit_flag = true;
     return ok;
@@ -275,6 +478,61 @@ static bool do_help(int argc, char *argv[])
     return true;
 }
 
+/* Smallest value at least the given share of the recorded ones fit under */
+static uint64_t latency_percentile(const struct LATENCY *lat, double share)
+{
+    uint64_t rank = (uint64_t) (share * lat->count);
+    if (rank >= lat->count)
+        rank = lat->count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen > rank) {
+            uint64_t value = latency_bucket_max(i);
+            return value < lat->max ? value : lat->max;
+        }
+    }
+    return lat->max;
+}
+
+/*
+ * Show the latencies recorded per command while option stats was set, in
+ * nanoseconds, or forget them.  Percentiles are the upper bounds of
+ * histogram buckets, within 1/32 of the true values.
+ */
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+        report(1, "%s takes no argument or reset", argv[0]);
+        return false;
+    }
+
+    bool reset = argc == 2;
+    bool any = false;
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        struct LATENCY *lat = c->latency;
+        if (!lat || !lat->count)
+            continue;
+        if (reset) {
+            memset(lat, 0, sizeof(*lat));
+            continue;
+        }
+        if (!any)
+            report(1, "%-10s %10s %10s %10s %10s %10s %10s", "command", "count",
+                   "mean", "p50", "p99", "p99.9", "max");
+        any = true;
+        report(1,
+               "%-10s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+               " %10" PRIu64 " %10" PRIu64,
+               c->name, lat->count, lat->sum / lat->count,
+               latency_percentile(lat, 0.5), latency_percentile(lat, 0.99),
+               latency_percentile(lat, 0.999), lat->max);
+    }
+    if (!reset && !any)
+        report(1, "No latencies recorded, see option stats");
+    return true;
+}
+
 static bool do_comment_cmd(int argc, char *argv[])
 {
     if (echo)
@@ -326,17 +584,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_ptr plist = table_get(&param_table, name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -379,29 +634,68 @@ static bool do_log(int argc, char *argv[])
 
 static bool do_time(int argc, char *argv[])
 {
-    double delta = delta_time(&last_time);
+    uint64_t delta = delta_time_ns(&last_time);
     bool ok = true;
     if (argc <= 1) {
-        double elapsed = last_time - first_time;
-        report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
+        uint64_t elapsed = last_time - first_time;
+        report(1, "Elapsed time = %.3f, Delta time = %.3f (%" PRIu64 " ns)",
+               1.0E-9 * elapsed, 1.0E-9 * delta, delta);
     } else {
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
         } else {
-            delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            delta = delta_time_ns(&last_time);
+            report(1, "Delta time = %.3f (%" PRIu64 " ns)", 1.0E-9 * delta,
+                   delta);
         }
     }
 
     return ok;
 }
 
+/* Run a command n times.  The command is looked up once, and its arguments
+ * are passed on as they are, so every run only costs the call itself.
+ */
+static bool do_repeat(int argc, char *argv[])
+{
+    int n;
+    if (argc < 3) {
+        report(1, "%s needs a count and a command", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &n) || n < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+
+    cmd_ptr cmd = table_get(&cmd_table, argv[2]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[2]);
+        return false;
+    }
+
+    /* Stop at the first failure, which the caller counts as one error */
+    for (int i = 0; i < n && !quit_flag; i++) {
+        if (!run_cmd(cmd, argc - 2, argv + 2))
+            return false;
+    }
+    return true;
+}
+
+static void tsc_changed(int oldval)
+{
+    if (!set_tsc_time(tsc_timing))
+        tsc_timing = 0;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    table_clear(&cmd_table);
+    table_clear(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -411,14 +705,21 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(repeat, " n cmd arg ...  | Run command n times");
+    ADD_COMMAND(stats,
+                " [reset]        | Show or clear per command latencies in ns");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("tsc", &tsc_timing, "Time commands with the cycle counter",
+              tsc_changed);
+    add_param("stats", &cmd_stats, "Record per command latencies for stats",
+              NULL);
 
     init_in();
-    init_time(&last_time);
+    init_time_ns(&last_time);
     first_time = last_time;
 }
 
@@ -440,7 +741,21 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
     rnew->prev = buf_stack;
+
+    /* Lines of a regular file are read straight from a mapping of it */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+            rnew->bufptr = map;
+            rnew->cnt = st.st_size;
+        }
+    }
     buf_stack = rnew;
 
     return true;
@@ -452,6 +767,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -463,68 +780,89 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
+static void echo_line(const char *line)
+{
+    if (echo)
+        report_noreturn(1, "%s%.*s\n", prompt, (int) line_length(line), line);
+}
+
+/* Read command from input file.  The line ends at its newline or a null
+ * character, and may be left in the input buffer or the mapping of the
+ * file, so it is only valid until the next read.
  * When hit EOF, close that file and return NULL
  */
 static char *readline()
 {
-    int cnt;
-    char c;
-    char *lptr = linebuf;
+    size_t len = 0;
 
     if (!buf_stack)
         return NULL;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    for (;;) {
         if (buf_stack->cnt <= 0) {
-            /* Need to read from input file */
-            buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
+            /* Need to read from input file, unless all of it is mapped */
+            if (!buf_stack->map)
+                buf_stack->cnt =
+                    read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
             buf_stack->bufptr = buf_stack->buf;
             if (buf_stack->cnt <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
+                if (len > 0) {
                     /* Last line of file did not terminate with newline. */
                     /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
+                    linebuf[len] = '\0';
+                    echo_line(linebuf);
                     return linebuf;
                 }
                 return NULL;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
-            break;
-    }
-
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
-    }
-    *lptr++ = '\0';
+        /* Have text in buffer.  Look for the end of the line in it, as far
+         * as the line may still extend.
+         */
+        char *start = buf_stack->bufptr;
+        size_t room = RIO_BUFSIZE - 2 - len;
+        size_t avail = (size_t) buf_stack->cnt < room ? buf_stack->cnt : room;
+        char *newline = memchr(start, '\n', avail);
+        size_t span = newline ? (size_t) (newline - start) + 1 : avail;
+        buf_stack->bufptr += span;
+        buf_stack->cnt -= span;
+
+        if (newline && len == 0) {
+            /* The whole line is in the buffer; hand it out from there */
+            echo_line(start);
+            return start;
+        }
 
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        memcpy(linebuf + len, start, span);
+        len += span;
+        if (newline) {
+            len--;
+            break;
+        }
+        if (len >= RIO_BUFSIZE - 2) {
+            /* Hit buffer limit.  Artificially terminate line */
+            break;
+        }
     }
 
+    linebuf[len] = '\0';
+    echo_line(linebuf);
     return linebuf;
 }
 
-static bool cmd_done()
+bool cmd_done()
 {
     return !buf_stack || quit_flag;
 }
 
+bool cmd_quit_given()
+{
+    return quit_flag;
+}
+
 /*
  * Handle command processing in program that uses select as main control loop.
  * Like select, but checks whether command input either present in internal
@@ -547,6 +885,16 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /* A command already in the input buffer needs no wait for input,
+     * unless the caller is waiting for something else as well
+     */
+    if (!block_flag && has_infile && buf_stack->cnt > 0 && nfds == 0) {
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -586,12 +934,192 @@ int cmd_select(int nfds,
     return result;
 }
 
+#ifdef __linux__
+
+/* Descriptor registered by cmd_epoll_add */
+typedef struct EPOLL_ELE epoll_ele, *epoll_ptr;
+struct EPOLL_ELE {
+    int fd;
+    fd_callback callback;
+    void *arg;
+    epoll_ptr next;
+};
+
+static int epoll_fd = -1;
+static epoll_ptr epoll_list = NULL;
+
+/* While cmd_epoll_wait runs callbacks, pending events may still point to
+ * descriptors they remove, so those are only freed once it is done
+ */
+static int epoll_depth = 0;
+static epoll_ptr epoll_removed = NULL;
+
+/* Command input watched by epoll, or -1 if it cannot be, as for a regular
+ * file, which is then read without waiting
+ */
+static int epoll_input_fd = -1;
+
+/* Read what is available from the command input after what is left in the
+ * buffer.  Return what read returned.
+ */
+static ssize_t rio_fill(rio_ptr rp)
+{
+    memmove(rp->buf, rp->bufptr, rp->cnt);
+    rp->bufptr = rp->buf;
+    ssize_t n = read(rp->fd, rp->buf + rp->cnt, RIO_BUFSIZE - rp->cnt);
+    if (n > 0)
+        rp->cnt += n;
+    return n;
+}
+
+/*
+ * Interpret every complete command available, without blocking.  Lines of
+ * files pushed by source are read to their end.  A partial line left from
+ * the watched input waits for the rest, unless that input has ended.
+ */
+static void drain_input(bool input_ended)
+{
+    while (!cmd_done() && !block_flag) {
+        rio_ptr rp = buf_stack;
+        if (rp->fd == epoll_input_fd && !input_ended) {
+            bool line_ready =
+                rp->cnt >= RIO_BUFSIZE - 2 ||
+                (rp->cnt > 0 && memchr(rp->bufptr, '\n', rp->cnt));
+            if (!line_ready)
+                break;
+        }
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+    }
+}
+
+bool cmd_epoll_open(char *infile_name)
+{
+    if (!push_file(infile_name)) {
+        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        return false;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        report(1, "ERROR: Could not create epoll instance");
+        return false;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_input_fd = buf_stack->fd;
+    if (buf_stack->map || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, epoll_input_fd,
+                                    &ev) < 0)
+        epoll_input_fd = -1;
+    return true;
+}
+
+bool cmd_epoll_add(int fd, uint32_t events, fd_callback callback, void *arg)
+{
+    if (epoll_fd < 0)
+        return false;
+    epoll_ptr ele = malloc_or_fail(sizeof(epoll_ele), "cmd_epoll_add");
+    ele->fd = fd;
+    ele->callback = callback;
+    ele->arg = arg;
+    struct epoll_event ev = {.events = events, .data.ptr = ele};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free_block(ele, sizeof(epoll_ele));
+        return false;
+    }
+    ele->next = epoll_list;
+    epoll_list = ele;
+    return true;
+}
+
+bool cmd_epoll_del(int fd)
+{
+    epoll_ptr *loc = &epoll_list;
+    while (*loc && (*loc)->fd != fd)
+        loc = &(*loc)->next;
+    if (!*loc)
+        return false;
+
+    epoll_ptr ele = *loc;
+    *loc = ele->next;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    if (epoll_depth > 0) {
+        ele->callback = NULL;
+        ele->next = epoll_removed;
+        epoll_removed = ele;
+    } else {
+        free_block(ele, sizeof(epoll_ele));
+    }
+    return true;
+}
+
+int cmd_epoll_wait(int timeout)
+{
+    if (epoll_fd < 0)
+        return -1;
+
+    /* Commands only run from the outermost call, not from one made by a
+     * command or callback, which leaves the input for it
+     */
+    bool outer = epoll_depth++ == 0;
+
+    /* Input that epoll cannot watch is always ready */
+    bool input_waiting = outer && !cmd_done() && epoll_input_fd < 0;
+    if (input_waiting) {
+        drain_input(false);
+        timeout = 0;
+    }
+
+    struct epoll_event events[16];
+    int n = epoll_wait(epoll_fd, events, 16, timeout);
+    for (int i = 0; i < n; i++) {
+        epoll_ptr ele = events[i].data.ptr;
+        if (ele) {
+            /* Unless an earlier callback or command removed it */
+            if (ele->callback)
+                ele->callback(ele->fd, events[i].events, ele->arg);
+            continue;
+        }
+        if (!outer)
+            continue;
+        /* Command input: take in what arrived, then run all whole lines */
+        if (cmd_done() || buf_stack->fd != epoll_input_fd) {
+            drain_input(false);
+            continue;
+        }
+        ssize_t got = rio_fill(buf_stack);
+        drain_input(got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR));
+    }
+
+    if (--epoll_depth == 0) {
+        while (epoll_removed) {
+            epoll_ptr ele = epoll_removed;
+            epoll_removed = ele->next;
+            free_block(ele, sizeof(epoll_ele));
+        }
+    }
+    return n < 0 ? -1 : n + input_waiting;
+}
+
+void cmd_epoll_close()
+{
+    while (epoll_list)
+        cmd_epoll_del(epoll_list->fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+    epoll_input_fd = -1;
+}
+
+#endif /* __linux__ */
+
 bool finish_cmd()
 {
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
     has_infile = false;
+    report_flush();
     return ok && err_cnt == 0;
 }
 
@@ -636,8 +1164,300 @@ void completion(const char *buf, linenoiseCompletions *lc)
     }
 }
 
+/*
+ * Compiled traces.
+ *
+ * A trace compiled with compile_trace holds its commands already split into
+ * words, so that replaying it skips reading, tokenizing and looking up
+ * every line.  In host byte order, it consists of
+ *
+ *   - a qbc_header_t,
+ *   - the offset of every string in the string data, as uint32_t,
+ *   - the string data: every distinct word once, null-terminated, padded
+ *     to a multiple of 4 bytes,
+ *   - the commands: for each, the index of the line as read, which is echoed
+ *     on replay, the number of words, and the index of each word in the
+ *     string table, as uint32_t.
+ *
+ * Commands read by source are compiled in place of the source command.
+ */
+
+#define QBC_MAGIC "QBC2"
+
+typedef struct {
+    char magic[4];         /* QBC_MAGIC */
+    uint32_t strings;      /* Number of distinct words and lines */
+    uint32_t string_bytes; /* Size of the string data, with padding */
+    uint32_t commands;     /* Number of commands */
+    uint32_t words;        /* Size of the commands, in uint32_t */
+} qbc_header_t;
+
+/* Growable array for building a compiled trace */
+typedef struct {
+    void *data;
+    size_t count; /* Elements in use */
+    size_t size;  /* Elements allocated */
+} qbc_array_t;
+
+static void *qbc_push(qbc_array_t *a, size_t elem_size)
+{
+    if (a->count == a->size) {
+        size_t size = a->size ? 2 * a->size : 1024;
+        void *data = calloc_or_fail(size, elem_size, "compile_trace");
+        if (a->data) {
+            memcpy(data, a->data, a->count * elem_size);
+            free_array(a->data, a->size, elem_size);
+        }
+        a->data = data;
+        a->size = size;
+    }
+    return (char *) a->data + elem_size * a->count++;
+}
+
+static void qbc_free(qbc_array_t *a, size_t elem_size)
+{
+    if (a->data)
+        free_array(a->data, a->size, elem_size);
+    memset(a, 0, sizeof(*a));
+}
+
+static bool qbc_write(const char *outfile,
+                      qbc_array_t *strings,
+                      qbc_array_t *words,
+                      uint32_t commands)
+{
+    FILE *out = fopen(outfile, "wb");
+    if (!out) {
+        report(1, "Could not open output file '%s'", outfile);
+        return false;
+    }
+
+    char **str = strings->data;
+    qbc_header_t header;
+    memcpy(header.magic, QBC_MAGIC, sizeof(header.magic));
+    header.strings = strings->count;
+    header.commands = commands;
+    header.words = words->count;
+
+    uint32_t offset = 0;
+    bool ok = true;
+    fwrite(&header, sizeof(header), 1, out);
+    for (size_t i = 0; i < strings->count; i++) {
+        fwrite(&offset, sizeof(offset), 1, out);
+        offset += strlen(str[i]) + 1;
+    }
+    for (size_t i = 0; i < strings->count; i++)
+        fwrite(str[i], strlen(str[i]) + 1, 1, out);
+    static const char padding[4];
+    fwrite(padding, 1, -offset & 3, out);
+    fwrite(words->data, sizeof(uint32_t), words->count, out);
+
+    /* The string data size is only known now */
+    header.string_bytes = offset + (-offset & 3);
+    if (fseek(out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1)
+        ok = false;
+    if (fclose(out) != 0 || !ok) {
+        report(1, "Could not write output file '%s'", outfile);
+        return false;
+    }
+    return true;
+}
+
+/* Index of s in the string table, adding it if new */
+static uint32_t qbc_intern(qbc_array_t *strings,
+                           name_table_t *interned,
+                           char *s)
+{
+    uintptr_t index = (uintptr_t) table_get(interned, s);
+    if (!index) {
+        char *str = strsave_or_fail(s, "compile_trace");
+        *(char **) qbc_push(strings, sizeof(char *)) = str;
+        index = strings->count;
+        table_put(interned, str, (void *) index);
+    }
+    return index - 1;
+}
+
+bool compile_trace(char *infile, char *outfile)
+{
+    if (!push_file(infile)) {
+        report(1, "ERROR: Could not open source file '%s'", infile);
+        return false;
+    }
+
+    /* Distinct words, and the table mapping each to its index + 1 */
+    qbc_array_t strings = {0}, words = {0};
+    name_table_t interned = {0};
+    uint32_t commands = 0;
+    bool ok = true;
+    int saved_echo = echo;
+    echo = 0;
+
+    while (ok && buf_stack) {
+        char *line = readline();
+        if (!line)
+            continue;
+
+        /* Lines are kept as read, empty ones too, so that replaying echoes
+         * the same
+         */
+        char text[RIO_BUFSIZE];
+        snprintf(text, sizeof(text), "%.*s", (int) line_length(line), line);
+        int argc;
+        char **argv = parse_args(line, &argc);
+        if (argc > 0 && strcmp(argv[0], "source") == 0) {
+            if (argc < 2 || !push_file(argv[1])) {
+                report(1, "Could not open source file '%s'",
+                       argc < 2 ? "" : argv[1]);
+                ok = false;
+            }
+            continue;
+        }
+
+        *(uint32_t *) qbc_push(&words, sizeof(uint32_t)) =
+            qbc_intern(&strings, &interned, text);
+        *(uint32_t *) qbc_push(&words, sizeof(uint32_t)) = argc;
+        for (int i = 0; i < argc; i++)
+            *(uint32_t *) qbc_push(&words, sizeof(uint32_t)) =
+                qbc_intern(&strings, &interned, argv[i]);
+        commands++;
+    }
+    while (buf_stack)
+        pop_file();
+    echo = saved_echo;
+    has_infile = false;
+
+    if (ok)
+        ok = qbc_write(outfile, &strings, &words, commands);
+    if (ok)
+        report(1, "Compiled %u commands with %zu distinct strings into '%s'",
+               commands, strings.count, outfile);
+
+    for (size_t i = 0; i < strings.count; i++)
+        free_string(((char **) strings.data)[i]);
+    qbc_free(&strings, sizeof(char *));
+    qbc_free(&words, sizeof(uint32_t));
+    table_clear(&interned);
+    return ok;
+}
+
+/* Check whether file name holds a compiled trace */
+static bool is_compiled_trace(const char *name)
+{
+    char magic[4];
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool found = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                 memcmp(magic, QBC_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return found;
+}
+
+/*
+ * Check that the sections of a compiled trace of size bytes fit in it,
+ * and that the commands only refer to existing strings.
+ */
+static bool qbc_valid(const char *map, size_t size)
+{
+    const qbc_header_t *h = (const qbc_header_t *) map;
+    if (size < sizeof(*h) || h->string_bytes % 4)
+        return false;
+    uint64_t need = sizeof(*h) + 4 * (uint64_t) h->strings + h->string_bytes +
+                    4 * (uint64_t) h->words;
+    if (need != size)
+        return false;
+
+    const uint32_t *offsets = (const uint32_t *) (map + sizeof(*h));
+    const char *data = (const char *) (offsets + h->strings);
+    for (uint32_t i = 0; i < h->strings; i++) {
+        if (offsets[i] >= h->string_bytes ||
+            !memchr(data + offsets[i], '\0', h->string_bytes - offsets[i]))
+            return false;
+    }
+
+    const uint32_t *word = (const uint32_t *) (data + h->string_bytes);
+    const uint32_t *end = word + h->words;
+    for (uint32_t c = 0; c < h->commands; c++) {
+        if (end - word < 2 || *word++ >= h->strings ||
+            *word > (size_t) (end - word - 1))
+            return false;
+        uint32_t argc = *word++;
+        for (uint32_t i = 0; i < argc; i++, word++) {
+            if (*word >= h->strings)
+                return false;
+        }
+    }
+    return word == end;
+}
+
+/*
+ * Run the commands of a compiled trace.  Its strings are used where they
+ * lie in the mapping of the file, and each distinct word is looked up as a
+ * command once, before running any.
+ */
+static bool run_compiled_trace(const char *name)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "ERROR: Could not open source file '%s'", name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    /* Private and writable, in case a command modifies its arguments */
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || !qbc_valid(map, size)) {
+        report(1, "ERROR: Invalid compiled trace '%s'", name);
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        return false;
+    }
+
+    const qbc_header_t *h = (const qbc_header_t *) map;
+    const uint32_t *offsets = (const uint32_t *) (map + sizeof(*h));
+    char *data = (char *) (offsets + h->strings);
+    const uint32_t *word = (const uint32_t *) (data + h->string_bytes);
+
+    size_t nstrings = h->strings ? h->strings : 1;
+    char **strings = calloc_or_fail(nstrings, sizeof(char *), "run_trace");
+    cmd_ptr *cmds = calloc_or_fail(nstrings, sizeof(cmd_ptr), "run_trace");
+    for (uint32_t i = 0; i < h->strings; i++) {
+        strings[i] = data + offsets[i];
+        cmds[i] = table_get(&cmd_table, strings[i]);
+    }
+
+    /* No command has more words than there are words in all commands */
+    size_t max_argc = h->words ? h->words : 1;
+    char **argv = calloc_or_fail(max_argc, sizeof(char *), "run_trace");
+
+    has_infile = true;
+    for (uint32_t c = 0; c < h->commands && !quit_flag; c++) {
+        echo_line(strings[*word++]);
+        int argc = *word++;
+        const uint32_t *args = word;
+        for (int i = 0; i < argc; i++)
+            argv[i] = strings[*word++];
+        if (argc > 0)
+            execute_cmd(cmds[args[0]], argc, argv);
+    }
+
+    free_array(argv, max_argc, sizeof(char *));
+    free_array(cmds, nstrings, sizeof(cmd_ptr));
+    free_array(strings, nstrings, sizeof(char *));
+    munmap(map, size);
+    return err_cnt == 0;
+}
+
 bool run_console(char *infile_name)
 {
+    if (infile_name && is_compiled_trace(infile_name))
+        return run_compiled_trace(infile_name);
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -1,6 +1,7 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
@@ -21,6 +22,8 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    /* Latencies recorded while option stats is set, NULL until then */
+    struct LATENCY *latency;
     cmd_ptr next;
 };
 
@@ -51,6 +54,11 @@ void add_param(char *name,
                char *doccumentation,
                setter_function setter);
 
+/* Execute a command that has already been split into arguments.
+ * Return true if it succeeded
+ */
+bool interpret_cmda(int argc, char *argv[]);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
@@ -75,10 +83,64 @@ int cmd_select(int nfds,
                fd_set *exceptfds,
                struct timeval *timeout);
 
-/* Run command loop.  Non-null infile_name implies read commands from that file
+/* Return true once the command input is exhausted or quit was given */
+bool cmd_done();
+
+/* Return true once quit was given, even while input remains */
+bool cmd_quit_given();
+
+#ifdef __linux__
+/*
+ * Event loop integration with epoll, for embedding the console in a program
+ * that serves other descriptors as well.  Unlike cmd_select, every complete
+ * command read is run at each wakeup, and there is no limit on descriptor
+ * numbers.
+ */
+
+/* Called when a descriptor registered with cmd_epoll_add is ready, with the
+ * epoll events that occurred
+ */
+typedef void (*fd_callback)(int fd, uint32_t events, void *arg);
+
+/* Read commands from file infile_name, or from stdin if NULL, and create the
+ * epoll instance watching it.  Return true if successful.
+ */
+bool cmd_epoll_open(char *infile_name);
+
+/* Watch fd for events, calling callback with arg when any occurs.
+ * Return true if successful.
+ */
+bool cmd_epoll_add(int fd, uint32_t events, fd_callback callback, void *arg);
+
+/* Stop watching fd.  Return false if it was not registered. */
+bool cmd_epoll_del(int fd);
+
+/*
+ * Wait up to timeout milliseconds, -1 for no limit, for command input or
+ * registered descriptors, run the commands and callbacks that are ready, and
+ * return the number of ready sources, or -1 on error.  Input from a regular
+ * file is always ready.  Loop until cmd_done() to run all commands.
+ * Commands and callbacks may call it in turn to serve the descriptors, but
+ * command input is then left for the outer call.
+ */
+int cmd_epoll_wait(int timeout);
+
+/* Unregister all descriptors and release the epoll instance */
+void cmd_epoll_close();
+#endif
+
+/* Run command loop.  Non-null infile_name implies read commands from that file,
+ * which may be a compiled trace
  */
 bool run_console(char *infile_name);
 
+/*
+ * Compile the commands of file infile, and of the files it sources, into
+ * file outfile, which run_console replays without parsing the commands.
+ * Return true if successful.
+ */
+bool compile_trace(char *infile, char *outfile);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
@@ -6,17 +6,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include "cpucycles.h"
 #include "queue.h"
 #include "random.h"
+#include "timer.h"
 
-#define N_MEASURE 150
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
 
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
-/* Number of measurements per test */
-const size_t n_measure = N_MEASURE;
+/* Number of measurements per batch */
+size_t n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
@@ -25,8 +27,22 @@ const int drop_size = 20;
  */
 static struct list_head *l = NULL;
 
-static char random_string[N_MEASURE][8];
-static int random_string_iter = 0;
+/* Queues kept between measurements in pooled mode, for empty inputs and
+ * for the others, and their sizes
+ */
+int pool_fixture = 1;
+static struct list_head *pool[2];
+static int pool_size[2];
+
+/* Elements from either end of the queue whose cache lines are set up before
+ * a measurement.  A constant time operation cannot reach further, and
+ * flushing a whole queue of thousands of elements every time would take
+ * far longer than the measurements themselves.
+ */
+#define cache_reach 16
+
+static char (*random_string)[8] = NULL;
+static size_t random_string_iter = 0;
 
 enum {
     test_insert_head,
@@ -35,15 +51,102 @@ enum {
     test_remove_tail,
 };
 
+static void run_size(struct list_head *head)
+{
+    q_size(head);
+}
+
+static void run_delete_mid(struct list_head *head)
+{
+    q_delete_mid(head);
+}
+
+static void run_delete_dup(struct list_head *head)
+{
+    q_delete_dup(head);
+}
+
+/* Operations checked by fitting their running time over queue sizes */
+static const measured_op_t measured_ops[] = {
+    {"size", complexity_n, run_size},
+    {"dm", complexity_n, run_delete_mid},
+    {"swap", complexity_n, q_swap},
+    {"reverse", complexity_n, q_reverse},
+    {"sort", complexity_nlogn, q_sort},
+    {"dedup", complexity_n, run_delete_dup},
+};
+
+const measured_op_t *find_measured_op(const char *name)
+{
+    for (size_t i = 0; i < sizeof(measured_ops) / sizeof(measured_ops[0]); i++)
+        if (!strcmp(measured_ops[i].name, name))
+            return &measured_ops[i];
+    return NULL;
+}
+
+int64_t measure_op(const measured_op_t *op, int size)
+{
+    char s[8];
+    dut_new();
+    for (int i = 0; i < size; i++) {
+        randombytes((uint8_t *) s, 7);
+        s[7] = 0;
+        q_insert_head(l, s);
+    }
+
+    /* Bring the queue into the cache, so that every size is measured with
+     * the same memory behavior
+     */
+    element_t *e;
+    size_t sum = 0;
+    list_for_each_entry (e, l, list)
+        sum += strlen(e->value);
+    __asm__ volatile("" ::"r"(sum));
+
+    int64_t before = timer_begin();
+    op->run(l);
+    int64_t after = timer_end();
+
+    /* The operation may have reordered the blocks, which makes checking
+     * each free against the allocated list quadratic
+     */
+    set_cautious_mode(false);
+    dut_free();
+    set_cautious_mode(true);
+    return after - before;
+}
+
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
+    free_dut();
     l = NULL;
 }
 
+void free_dut(void)
+{
+    for (int i = 0; i < 2; i++) {
+        q_free(pool[i]);
+        pool[i] = NULL;
+    }
+}
+
+bool init_batch(void)
+{
+    random_string = calloc(n_measure, sizeof(*random_string));
+    random_string_iter = 0;
+    return random_string != NULL;
+}
+
+void free_batch(void)
+{
+    free(random_string);
+    random_string = NULL;
+}
+
 char *get_random_string(void)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURE;
+    random_string_iter = (random_string_iter + 1) % n_measure;
     return random_string[random_string_iter];
 }
 
@@ -56,17 +159,126 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
+    for (size_t i = 0; i < n_measure; ++i) {
         /* Generate random string */
         randombytes((uint8_t *) random_string[i], 7);
         random_string[i][7] = 0;
     }
 }
 
+/* Size of the queue a measurement starts from */
+static int input_size(const uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * chunk_size) % 10000;
+}
+
+/*
+ * Make l a queue of size random strings.  In pooled mode the queue kept for
+ * empty or non-empty inputs is grown or shrunk to size, rather than a new
+ * one built from scratch.
+ */
+static void dut_get(int size)
+{
+    if (!pool_fixture) {
+        dut_new();
+        dut_insert_head(get_random_string(), size);
+        return;
+    }
+
+    int which = size > 0;
+    if (!pool[which]) {
+        pool[which] = q_new();
+        pool_size[which] = 0;
+    }
+    l = pool[which];
+    for (; pool_size[which] < size; pool_size[which]++)
+        q_insert_head(l, get_random_string());
+    for (; pool_size[which] > size; pool_size[which]--) {
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (!e) {
+            pool_size[which] = 0;
+            break;
+        }
+        q_release_element(e);
+    }
+}
+
+/* Give back the queue taken by dut_get, after the measured operation
+ * changed its size by delta
+ */
+static void dut_put(int delta)
+{
+    if (!pool_fixture) {
+        dut_free();
+        return;
+    }
+    pool_size[l == pool[1]] += delta;
+}
+
+static inline void flush_line(const void *p)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile("clflush %0" ::"m"(*(const char *) p));
+#elif defined(__aarch64__)
+    asm volatile("dc civac, %0" ::"r"(p) : "memory");
+#endif
+}
+
+/* Wait for the flushes to complete */
+static inline void flush_fence(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile("mfence" ::: "memory");
+#elif defined(__aarch64__)
+    asm volatile("dsb ish" ::: "memory");
+#endif
+}
+
+/*
+ * Load or flush the cache lines of the queue head, the elements near either
+ * end and their strings, and of s, the string about to be inserted.
+ */
+static void set_cache(int cache, const char *s)
+{
+    const void *lines[2 + 4 * cache_reach];
+    size_t n = 0;
+    if (cache != cache_warm && cache != cache_cold)
+        return;
+
+    /* Collect the addresses first, since following the links would load
+     * the lines flushed so far again
+     */
+    lines[n++] = l;
+    if (s)
+        lines[n++] = s;
+    struct list_head *node = l->next;
+    for (int i = 0; i < cache_reach && node != l; i++, node = node->next) {
+        element_t *e = list_entry(node, element_t, list);
+        lines[n++] = e;
+        lines[n++] = e->value;
+    }
+    node = l->prev;
+    for (int i = 0; i < cache_reach && node != l; i++, node = node->prev) {
+        element_t *e = list_entry(node, element_t, list);
+        lines[n++] = e;
+        lines[n++] = e->value;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (cache == cache_cold)
+            flush_line(lines[i]);
+        else
+            (void) *(volatile const char *) lines[i];
+    }
+    if (cache == cache_cold)
+        flush_fence();
+}
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
-             int mode)
+             int mode,
+             int cache)
 {
     assert(mode == test_insert_head || mode == test_insert_tail ||
            mode == test_remove_head || mode == test_remove_tail);
@@ -75,67 +287,57 @@ void measure(int64_t *before_ticks,
     case test_insert_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_get(input_size(input_data, i));
+            set_cache(cache, s);
+            before_ticks[i] = timer_begin();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = timer_end();
+            dut_put(1);
         }
         break;
     case test_insert_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_get(input_size(input_data, i));
+            set_cache(cache, s);
+            before_ticks[i] = timer_begin();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = timer_end();
+            dut_put(1);
         }
         break;
     case test_remove_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_get(input_size(input_data, i));
+            set_cache(cache, NULL);
+            before_ticks[i] = timer_begin();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timer_end();
             if (e)
                 q_release_element(e);
-            dut_free();
+            dut_put(e ? -1 : 0);
         }
         break;
     case test_remove_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_get(input_size(input_data, i));
+            set_cache(cache, NULL);
+            before_ticks[i] = timer_begin();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = timer_end();
             if (e)
                 q_release_element(e);
-            dut_free();
+            dut_put(e ? -1 : 0);
         }
         break;
     default:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_get(input_size(input_data, i));
+            set_cache(cache, NULL);
+            before_ticks[i] = timer_begin();
             dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = timer_end();
+            dut_put(0);
         }
     }
 }
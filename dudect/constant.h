@@ -1,7 +1,12 @@
 #ifndef DUDECT_CONSTANT_H
 #define DUDECT_CONSTANT_H
 
+#include <stdbool.h>
 #include <stdint.h>
+
+/* Default number of measurements per batch */
+#define N_MEASURE 150
+
 #define dut_new() ((void) (l = q_new()))
 
 #define dut_size(n)                                \
@@ -26,11 +31,53 @@
 
 #define dut_free() ((void) (q_free(l)))
 
+/* Ways the running time of an operation may grow with the queue size */
+typedef enum {
+    complexity_1,
+    complexity_n,
+    complexity_nlogn,
+    complexity_n2,
+    complexity_classes,
+} complexity_t;
+
+struct list_head;
+
+/* A queue operation whose running time is fitted over growing queues */
+typedef struct {
+    const char *name;      /* Command running the operation */
+    complexity_t expected; /* Class a correct implementation has */
+    void (*run)(struct list_head *l);
+} measured_op_t;
+
+/* Return the measured operation run by command name, or NULL */
+const measured_op_t *find_measured_op(const char *name);
+
+/* Time a single run of op on a queue of size random strings */
+int64_t measure_op(const measured_op_t *op, int size);
+
+/* Cache state the queue is put in before each measured operation */
+enum {
+    cache_any,  /* Whatever the previous measurement left */
+    cache_warm, /* Lines the operation may touch are loaded */
+    cache_cold, /* Lines the operation may touch are flushed */
+    cache_both, /* Test with a warm and with a cold cache, separately */
+    cache_modes,
+};
+
+/* Keep the measured queues between measurements instead of rebuilding them */
+extern int pool_fixture;
+
 void init_dut();
+/* Release the queues kept in pooled mode */
+void free_dut(void);
+/* Allocate and release the inputs of a batch of n_measure measurements */
+bool init_batch(void);
+void free_batch(void);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
-             int mode);
+             int mode,
+             int cache);
 
 #endif
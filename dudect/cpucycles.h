@@ -21,3 +21,43 @@ static inline int64_t cpucycles(void)
 #error Unsupported Architecture
 #endif
 }
+
+/* Read the counter at the start of a measured region.  The fence keeps
+ * earlier instructions from still being in flight when the counter is read.
+ */
+static inline int64_t cpucycles_begin(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\t" : "=a"(lo), "=d"(hi)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+/* Read the counter at the end of a measured region.  rdtscp waits for the
+ * measured instructions to retire, and the trailing fence keeps later
+ * instructions from starting before the counter is read.
+ */
+static inline int64_t cpucycles_end(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
@@ -22,8 +22,12 @@
  *    probably redundant since we're doing as well a t-test on cropped
  *    measurements (non-linear transform)
  *
- *  - as long as any of the different test fails, the code will be deemed
- *    variable time.
+ *  - the paper deems the code variable time as soon as any of the tests
+ *    fails. The cropped tests are sensitive enough to pick up the allocator
+ *    and cache state that differs between an empty and a populated queue,
+ *    which has nothing to do with the queue operation itself. We therefore
+ *    only let the uncropped and the second order tests decide the outcome,
+ *    and report their t next to the largest t of all tests.
  */
 
 #include "fixture.h"
@@ -33,18 +37,85 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
+#include "timer.h"
 #include "ttest.h"
 
 #define enough_measure 10000
 #define test_tries 10
 
+/* Cropped t-tests, each keeping only the measurements below a percentile */
+#define number_percentiles 100
+
+/* Uncropped test, cropped tests, then the second order test */
+#define number_tests (1 + number_percentiles + 1)
+#define second_order_test (1 + number_percentiles)
+
+/* Measurements used for computing the cropping thresholds */
+#define warmup_measure 1000
+
+/* Measurements a test needs before it can decide the outcome */
+#define min_test_measure 1000
+
+/* Queue sizes the complexity is fitted over, doubling from the smallest.
+ * They are kept small enough for the queue to stay in the cache.
+ */
+#define complexity_min_size 512
+#define complexity_sizes 4
+
+/* Runs per queue size; the median is used */
+#define complexity_trials 9
+
+/* Relative error a slower growing class may fit worse than the best one */
+#define complexity_tolerance 0.1
+
+/* Variation of the timer rate over a fixed workload worth a warning */
+#define drift_warning 0.1
+
+/* Measurements needed before a try may stop early */
+#define early_stop_after 2000
+
+/* Consecutive batches the projected t must stay below the threshold */
+#define stable_batches 10
+
 extern const int drop_size;
 extern const size_t chunk_size;
-extern const size_t n_measure;
+extern size_t n_measure;
 static t_ctx *t;
+static int64_t percentiles[number_percentiles];
+
+/* Moments of the uncropped times, from which the second order test is set
+ * up whenever it is needed, so that it can be merged like the others
+ */
+static t_moments moments;
+
+/* Buffers of one batch, allocated once per tested operation */
+static int64_t *before_ticks, *after_ticks, *exec_times;
+static uint8_t *classes, *input_data;
+
+/* Batches in a row whose projected t stayed below the threshold */
+static int stable_count;
+
+/* Outcome of a try so far */
+typedef enum { verdict_pending, verdict_pass, verdict_fail } verdict_t;
+
+int batch_size = N_MEASURE;
+int worker_count = 1;
+int cache_mode = cache_any;
+
+/* Cache state of the test running now, never cache_both */
+static int cache_state;
+
+/* Raw measurements are written here as CSV, when set */
+#define export_bufsize (1 << 20)
+static FILE *export_file = NULL;
+static char *export_name = NULL;
+static const char *export_op;
+static unsigned int export_batch;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -74,24 +145,82 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several cropping
+         * thresholds
+         */
+        for (size_t crop = 0; crop < number_percentiles; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&t[crop + 1], difference, classes[i]);
+        }
+
+        /* second order t-test on the centered squared execution time */
+        t_moments_push(&moments, difference, classes[i]);
     }
 }
 
-static bool report(void)
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set the cropping thresholds from the distribution of warm-up measurements.
+ * The thresholds are spaced so that more of them fall in the tail:
+ * percentile i keeps the fastest 1 - 0.5^(10 * (i + 1) / 100) share.
+ */
+static void prepare_percentiles(int64_t *samples, size_t n)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
-    double max_tau = max_t / sqrt(number_traces_max_t);
+    qsort(samples, n, sizeof(int64_t), cmp_int64);
+    for (size_t i = 0; i < number_percentiles; i++) {
+        double which =
+            1 - pow(0.5, 10 * (double) (i + 1) / number_percentiles);
+        percentiles[i] = samples[(size_t) (which * n)];
+    }
+}
+
+/* Return the test with the largest t among those with enough measurements */
+static size_t max_test(void)
+{
+    size_t ret = 0;
+    double max = 0;
+    for (size_t i = 0; i < number_tests; i++) {
+        if (t[i].n[0] + t[i].n[1] < min_test_measure)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
+    }
+    return ret;
+}
+
+static verdict_t report(void)
+{
+    t_second_order(&t[second_order_test], &moments);
+    size_t test = max_test();
+    double max_t = fabs(t_compute(&t[test]));
+    double number_traces_max_t = t[0].n[0] + t[0].n[1];
+    double max_tau = max_t / sqrt(t[test].n[0] + t[test].n[1]);
 
     printf("\033[A\033[2K");
     printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    if (number_traces_max_t < early_stop_after) {
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
-        return false;
+               early_stop_after - number_traces_max_t);
+        return verdict_pending;
     }
 
+    if (test == 0)
+        printf("uncropped, ");
+    else if (test == second_order_test)
+        printf("second order, ");
+    else
+        printf("cropped at %lld, ", (long long) percentiles[test - 1]);
+
     /* max_t: the t statistic value
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
@@ -102,75 +231,464 @@ static bool report(void)
      *            detect the leak, if present. "barely detect the
      *            leak" = have a t value greater than 5.
      */
-    printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n", max_t, max_tau,
-           (double) (5 * 5) / (double) (max_tau * max_tau));
+    double decisive_t = fabs(t_compute(&t[0]));
+    if (t[second_order_test].n[0] + t[second_order_test].n[1] >=
+        min_test_measure)
+        decisive_t = fmax(decisive_t, fabs(t_compute(&t[second_order_test])));
 
-    /* Definitely not constant time */
-    if (max_t > t_threshold_bananas)
-        return false;
+    /* decisive t: the largest t of the tests deciding the outcome */
+    printf(
+        "max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e, decisive t: %.2f.\n",
+        max_t, max_tau, (double) (5 * 5) / (double) (max_tau * max_tau),
+        decisive_t);
 
-    /* Probably not constant time. */
-    if (max_t > t_threshold_moderate)
-        return false;
+    /* Definitely not constant time, no point in going on */
+    if (decisive_t > t_threshold_bananas)
+        return verdict_fail;
+
+    if (number_traces_max_t >= enough_measure) {
+        /* Probably not constant time. */
+        if (decisive_t > t_threshold_moderate)
+            return verdict_fail;
+        return verdict_pass;
+    }
+
+    /* t grows with the square root of the number of measurements if there
+     * is a leak.  Once the value projected to enough_measure has stayed
+     * below the threshold for a while, the outcome is settled.
+     */
+    double projected_t =
+        decisive_t * sqrt(enough_measure / number_traces_max_t);
+    if (projected_t > t_threshold_moderate)
+        stable_count = 0;
+    else if (++stable_count >= stable_batches)
+        return verdict_pass;
 
     /* For the moment, maybe constant time. */
+    return verdict_pending;
+}
+
+static bool open_export(const char *name)
+{
+    export_file = fopen(name, "w");
+    if (!export_file)
+        return false;
+    setvbuf(export_file, NULL, _IOFBF, export_bufsize);
+    fprintf(export_file, "op,batch,class,cycles\n");
     return true;
 }
 
-static bool doit(int mode)
+bool set_export_file(const char *name)
 {
-    int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(n_measure, sizeof(int64_t));
-    uint8_t *classes = calloc(n_measure, sizeof(uint8_t));
-    uint8_t *input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    if (export_file)
+        fclose(export_file);
+    export_file = NULL;
+    free(export_name);
+    export_name = NULL;
+    if (!name)
+        return true;
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
+    export_name = strdup(name);
+    if (!export_name || !open_export(name)) {
+        free(export_name);
+        export_name = NULL;
+        return false;
     }
+    return true;
+}
 
+static void export_batch_times(void)
+{
+    for (size_t i = 0; i < n_measure; i++) {
+        if (exec_times[i] > 0)
+            fprintf(export_file, "%s,%u,%u,%lld\n", export_op, export_batch,
+                    classes[i], (long long) exec_times[i]);
+    }
+    export_batch++;
+}
+
+static void measure_batch(int mode)
+{
     prepare_inputs(input_data, classes);
 
-    measure(before_ticks, after_ticks, input_data, mode);
+    measure(before_ticks, after_ticks, input_data, mode, cache_state);
     differentiate(exec_times, before_ticks, after_ticks);
     update_statistics(exec_times, classes);
-    bool ret = report();
+    if (export_file)
+        export_batch_times();
+}
+
+static verdict_t doit(int mode)
+{
+    measure_batch(mode);
+    return report();
+}
+
+/*
+ * Take share measurements in a child process pinned to a CPU of its own,
+ * and send the statistics back through fd.
+ */
+static void __attribute__((noreturn))
+run_worker(int mode, int worker, int fd, double share)
+{
+    /* Otherwise every worker would measure the same inputs */
+    randombytes_reseed();
+
+    /* The perf counter and the pinning of the parent do not carry over */
+    int cpu = timer_worker_cpu(worker);
+    timer_teardown();
+    timer_cpu = cpu;
+    if (!timer_setup())
+        _exit(1);
+
+    /* Each worker exports to a file of its own, name.worker */
+    if (export_file) {
+        fclose(export_file);
+        char name[FILENAME_MAX];
+        snprintf(name, sizeof(name), "%s.%d", export_name, worker);
+        if (!open_export(name))
+            _exit(1);
+    }
+
+    while (t[0].n[0] + t[0].n[1] < share)
+        measure_batch(mode);
+
+    if (export_file)
+        fclose(export_file);
+    ssize_t size = number_tests * sizeof(t_ctx);
+    bool sent = write(fd, t, size) == size &&
+                write(fd, &moments, sizeof(moments)) == sizeof(moments);
+    _exit(sent ? 0 : 1);
+}
+
+/* Read exactly size bytes from fd into buf */
+static bool read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, (char *) buf + done, size - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/* Collect the statistics sent by a worker into part and part_moments */
+static bool read_worker(int fd, t_ctx *part, t_moments *part_moments)
+{
+    return read_full(fd, part, number_tests * sizeof(t_ctx)) &&
+           read_full(fd, part_moments, sizeof(t_moments));
+}
+
+/*
+ * Split the measurements of a try over several processes, each with its own
+ * queue and statistics, and merge the statistics when all are done.  The
+ * outcome is decided on the merged statistics as for a serial try.
+ */
+static verdict_t run_workers(int mode, int workers)
+{
+    double share = ceil((double) enough_measure / workers);
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    int *fds = calloc(workers, sizeof(int));
+    t_ctx *part = calloc(number_tests, sizeof(t_ctx));
+    if (!pids || !fds || !part)
+        die();
+
+    int started = 0;
+    bool ok = true;
+    fflush(stdout);
+    if (export_file)
+        fflush(export_file);
+    for (; started < workers; started++) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0) {
+            ok = false;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            run_worker(mode, started, pipefd[1], share);
+        }
+        close(pipefd[1]);
+        if (pid < 0) {
+            close(pipefd[0]);
+            ok = false;
+            break;
+        }
+        pids[started] = pid;
+        fds[started] = pipefd[0];
+    }
+
+    for (int i = 0; i < started; i++) {
+        int status;
+        t_moments part_moments;
+        bool got = read_worker(fds[i], part, &part_moments);
+        close(fds[i]);
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            got = false;
+        if (!got) {
+            ok = false;
+            continue;
+        }
+        for (size_t j = 0; j < number_tests; j++)
+            t_merge(&t[j], &part[j]);
+        t_moments_merge(&moments, &part_moments);
+    }
+
+    free(pids);
+    free(fds);
+    free(part);
+    if (!ok) {
+        printf("\033[A\033[2K");
+        printf("measurement workers failed.\n");
+        return verdict_fail;
+    }
+    return report();
+}
+
+static void init_once(void)
+{
+    init_dut();
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&t[i]);
+    t_moments_init(&moments);
+    stable_count = 0;
+}
 
+int min_batch_size(void)
+{
+    return 2 * drop_size + 1;
+}
+
+static bool alloc_buffers(void)
+{
+    n_measure = batch_size;
+    before_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    after_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    exec_times = calloc(n_measure, sizeof(int64_t));
+    classes = calloc(n_measure, sizeof(uint8_t));
+    input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    t = calloc(number_tests, sizeof(t_ctx));
+    return before_ticks && after_ticks && exec_times && classes &&
+           input_data && t && init_batch();
+}
+
+static void free_buffers(void)
+{
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
-
-    return ret;
+    free(t);
+    free_batch();
+    free_dut();
 }
 
-static void init_once(void)
+/*
+ * Measure without keeping statistics, to settle the cropping thresholds.
+ * Return the median measurement.
+ */
+static int64_t warm_up(int mode)
 {
+    int64_t *samples = calloc(warmup_measure + n_measure, sizeof(int64_t));
+    if (!samples)
+        die();
+
     init_dut();
-    t_init(t);
+    size_t n = 0;
+    while (n < warmup_measure) {
+        prepare_inputs(input_data, classes);
+        measure(before_ticks, after_ticks, input_data, mode, cache_state);
+        differentiate(exec_times, before_ticks, after_ticks);
+        for (size_t i = 0; i < n_measure; i++) {
+            if (exec_times[i] > 0)
+                samples[n++] = exec_times[i];
+        }
+    }
+    prepare_percentiles(samples, n);
+    int64_t median = samples[n / 2];
+    free(samples);
+    return median;
 }
 
-static bool TEST_CONST(char *text, int mode)
+/*
+ * Warn about measurements the timer cannot resolve: an operation taking
+ * about as long as reading the timer twice, or a cycle counter whose rate
+ * relative to the core clock changes during the test.
+ */
+static void check_timer(const char *text, int64_t median)
+{
+    timer_calibration_t cal;
+    timer_calibrate(&cal);
+    if (median - cal.median <= cal.spread)
+        printf("Warning: %s takes %lld ticks, within the noise of the timer "
+               "overhead of %lld (spread %lld)\n",
+               text, (long long) median, (long long) cal.median,
+               (long long) cal.spread);
+
+    double drift = timer_rate_drift();
+    if (drift > drift_warning)
+        printf("Warning: timer rate varies by %.0f%%, the core clock is "
+               "probably scaled\n",
+               drift * 100);
+}
+
+static bool test_const(const char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    if (!timer_setup())
+        return false;
+    if (!alloc_buffers())
+        die();
+
+    check_timer(text, warm_up(mode));
+    export_op = text;
+    export_batch = 0;
 
+    int workers = worker_count > 0 ? worker_count : timer_cpu_count();
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
         init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        verdict_t verdict;
+        if (workers > 1)
+            verdict = run_workers(mode, workers);
+        else {
+            do
+                verdict = doit(mode);
+            while (verdict == verdict_pending);
+        }
         printf("\033[A\033[2K\033[A\033[2K");
+        result = verdict == verdict_pass;
         if (result == true)
             break;
     }
-    free(t);
+    free_buffers();
+    timer_teardown();
+    if (export_file)
+        fflush(export_file);
     return result;
 }
 
+/*
+ * Test with the cache state asked for.  With cache_both the test is run with
+ * a warm and with a cold cache, named text/warm and text/cold in the output
+ * and the exported measurements, and passes only if both do.  An operation
+ * passing warm but failing cold takes longer on a larger queue because of
+ * the memory it touches, rather than because of the work it does.
+ */
+static bool TEST_CONST(char *text, int mode)
+{
+    if (cache_mode != cache_both) {
+        cache_state = cache_mode;
+        return test_const(text, mode);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s/warm", text);
+    cache_state = cache_warm;
+    bool warm = test_const(name, mode);
+    snprintf(name, sizeof(name), "%s/cold", text);
+    cache_state = cache_cold;
+    bool cold = test_const(name, mode);
+
+    printf("%s: %sconstant time with a warm cache, %sconstant time with a "
+           "cold cache\n",
+           text, warm ? "" : "not ", cold ? "" : "not ");
+    return warm && cold;
+}
+
+static const char *complexity_names[complexity_classes] = {
+    "O(1)",
+    "O(n)",
+    "O(n log n)",
+    "O(n^2)",
+};
+
+const char *complexity_name(complexity_t c)
+{
+    return complexity_names[c];
+}
+
+static double complexity_scale(complexity_t c, double n)
+{
+    switch (c) {
+    case complexity_n:
+        return n;
+    case complexity_nlogn:
+        return n * log2(n);
+    case complexity_n2:
+        return n * n;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Fit time = coef * g(n) for the scaling g of every class, minimizing the
+ * error relative to the measured times, so that every size weighs the same.
+ * Memory effects make the time per element drift somewhat even for a linear
+ * operation, so the slowest growing class whose error is within
+ * complexity_tolerance of the best fit is taken.
+ */
+static complexity_t fit_complexity(const double *sizes, const double *times)
+{
+    double err[complexity_classes];
+    double best_err = INFINITY;
+    for (complexity_t c = complexity_1; c < complexity_classes; c++) {
+        double sum_r = 0, sum_rr = 0;
+        for (int i = 0; i < complexity_sizes; i++) {
+            double r = complexity_scale(c, sizes[i]) / times[i];
+            sum_r += r;
+            sum_rr += r * r;
+        }
+        double coef = sum_r / sum_rr;
+
+        double sum_sq = 0;
+        for (int i = 0; i < complexity_sizes; i++) {
+            double diff = 1 - coef * complexity_scale(c, sizes[i]) / times[i];
+            sum_sq += diff * diff;
+        }
+        err[c] = sqrt(sum_sq / complexity_sizes);
+        best_err = fmin(best_err, err[c]);
+    }
+
+    complexity_t c = complexity_1;
+    while (err[c] > best_err + complexity_tolerance)
+        c++;
+    return c;
+}
+
+bool estimate_complexity(const char *name,
+                         complexity_t *expected,
+                         complexity_t *found)
+{
+    const measured_op_t *op = find_measured_op(name);
+    if (!op || !timer_setup())
+        return false;
+
+    double sizes[complexity_sizes], times[complexity_sizes];
+    int64_t trials[complexity_trials];
+    int size = complexity_min_size;
+    for (int i = 0; i < complexity_sizes; i++, size *= 2) {
+        printf("Measuring %s...(%d/%d)\n", name, i, complexity_sizes);
+        for (int j = 0; j < complexity_trials; j++)
+            trials[j] = measure_op(op, size);
+        qsort(trials, complexity_trials, sizeof(int64_t), cmp_int64);
+        sizes[i] = size;
+        times[i] = trials[complexity_trials / 2];
+        printf("\033[A\033[2K");
+    }
+    timer_teardown();
+
+    *expected = op->expected;
+    *found = fit_complexity(sizes, times);
+    return true;
+}
+
 bool is_insert_head_const(void)
 {
     return TEST_CONST("insert_head", 0);
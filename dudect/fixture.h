@@ -4,10 +4,42 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of measurements taken per batch */
+extern int batch_size;
+
+/* Number of processes splitting the measurements, 0 for one per CPU */
+extern int worker_count;
+
+/* Cache state of the queue before each measurement, see constant.h */
+extern int cache_mode;
+
+/*
+ * Write every measurement of the constant time tests to file name as CSV
+ * lines of operation, batch, class and cycles.  With several workers, each
+ * writes to name.worker instead.  A NULL name stops exporting.
+ * Return false if the file cannot be opened.
+ */
+bool set_export_file(const char *name);
+
+/* Smallest batch that leaves measurements after dropping the outer ones */
+int min_batch_size(void);
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
 bool is_remove_head_const(void);
 bool is_remove_tail_const(void);
 
+/*
+ * Estimate how the running time of the operation run by command name grows
+ * with the queue size, and look up how it should grow.
+ * Return false if the operation cannot be measured.
+ */
+bool estimate_complexity(const char *name,
+                         complexity_t *expected,
+                         complexity_t *found);
+
+/* Big-O notation of a complexity class */
+const char *complexity_name(complexity_t c);
+
 #endif
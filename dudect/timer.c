@@ -0,0 +1,312 @@
+/**
+ * Timing backends for the constant time tests.
+ *
+ * The bare cycle counter read used originally is not serialized, so an
+ * out-of-order core may read it while the measured code is still in flight,
+ * which blurs operations that take only a few dozen cycles.  The fenced
+ * backend orders the reads against the measured code, and the perf backends
+ * count core cycles or retired instructions of this process only, which
+ * frequency scaling and other processes do not disturb.
+ *
+ * Measurements can also be pinned to one CPU, so that the process is not
+ * migrated between cores with unsynchronized counters or cold caches.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "timer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../report.h"
+
+/* Number of empty regions timed to find the overhead */
+#define overhead_measure 10000
+
+/* Rounds of runs of a chain of drift_work multiplications timed to look for
+ * a changing core clock
+ */
+#define drift_rounds 8
+#define drift_runs 5
+#define drift_work 200000
+
+int timer_backend = timer_rdtsc;
+int timer_cpu = -1;
+
+static const char *names[timer_backends] = {
+    "rdtsc",
+    "fenced rdtsc",
+    "perf cycles",
+    "perf instructions",
+};
+
+const char *timer_name(int backend)
+{
+    if (backend < 0 || backend >= timer_backends)
+        return "unknown";
+    return names[backend];
+}
+
+#ifdef __linux__
+
+static int perf_fd = -1;
+static struct perf_event_mmap_page *perf_page = NULL;
+static long page_size;
+
+static bool pinned = false;
+static cpu_set_t saved_affinity;
+
+static bool perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0) {
+        report(1, "Cannot open perf counter: %s", strerror(errno));
+        return false;
+    }
+
+    /* With the counter page mapped, the counter can be read with rdpmc
+     * instead of a system call.  Fall back to read() if that is not allowed.
+     */
+    page_size = sysconf(_SC_PAGESIZE);
+    perf_page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, perf_fd, 0);
+    if (perf_page == MAP_FAILED)
+        perf_page = NULL;
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+}
+
+static void perf_close(void)
+{
+    if (perf_page)
+        munmap(perf_page, page_size);
+    perf_page = NULL;
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_fd = -1;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static bool perf_rdpmc(int64_t *count)
+{
+    struct perf_event_mmap_page *pc = perf_page;
+    uint32_t seq;
+    int64_t value;
+
+    do {
+        seq = pc->lock;
+        __asm__ volatile("" ::: "memory");
+        uint32_t index = pc->index;
+        if (!pc->cap_user_rdpmc || !index)
+            return false;
+        value = pc->offset;
+
+        unsigned int hi, lo;
+        __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+        int64_t pmc = ((int64_t) lo) | (((int64_t) hi) << 32);
+        /* The hardware counter is pmc_width bits wide; sign-extend it */
+        int shift = 64 - pc->pmc_width;
+        value += (int64_t) ((uint64_t) pmc << shift) >> shift;
+        __asm__ volatile("" ::: "memory");
+    } while (pc->lock != seq);
+
+    *count = value;
+    return true;
+}
+#else
+static bool perf_rdpmc(int64_t *count)
+{
+    return false;
+}
+#endif
+
+int64_t perf_counter_read(void)
+{
+    int64_t count = 0;
+    if (perf_page && perf_rdpmc(&count))
+        return count;
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+static bool pin(void)
+{
+    if (timer_cpu < 0)
+        return true;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(timer_cpu, &set);
+    if (sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity) < 0 ||
+        sched_setaffinity(0, sizeof(set), &set) < 0) {
+        report(1, "Cannot pin to CPU %d: %s", timer_cpu, strerror(errno));
+        return false;
+    }
+    pinned = true;
+    return true;
+}
+
+static void unpin(void)
+{
+    if (pinned)
+        sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    pinned = false;
+}
+
+bool timer_setup(void)
+{
+    if (!pin())
+        return false;
+
+    bool ok = true;
+    if (timer_backend == timer_perf_cycles)
+        ok = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    else if (timer_backend == timer_perf_instructions)
+        ok = perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+    if (!ok)
+        unpin();
+    return ok;
+}
+
+void timer_teardown(void)
+{
+    perf_close();
+    unpin();
+}
+
+/* CPUs the process may run on, before any pinning by timer_setup */
+static bool allowed_cpus(cpu_set_t *set)
+{
+    if (pinned) {
+        *set = saved_affinity;
+        return true;
+    }
+    return sched_getaffinity(0, sizeof(*set), set) == 0;
+}
+
+int timer_cpu_count(void)
+{
+    cpu_set_t set;
+    if (!allowed_cpus(&set))
+        return 1;
+    return CPU_COUNT(&set);
+}
+
+int timer_worker_cpu(int worker)
+{
+    cpu_set_t set;
+    if (!allowed_cpus(&set) || !CPU_COUNT(&set))
+        return -1;
+    worker %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && worker-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+#else /* !__linux__ */
+
+int timer_cpu_count(void)
+{
+    return 1;
+}
+
+int timer_worker_cpu(int worker)
+{
+    return -1;
+}
+
+int64_t perf_counter_read(void)
+{
+    return 0;
+}
+
+bool timer_setup(void)
+{
+    if (timer_backend == timer_perf_cycles ||
+        timer_backend == timer_perf_instructions) {
+        report(1, "Perf counters are only supported on Linux");
+        return false;
+    }
+    if (timer_cpu >= 0) {
+        report(1, "CPU pinning is only supported on Linux");
+        return false;
+    }
+    return true;
+}
+
+void timer_teardown(void) {}
+
+#endif
+
+static int cmp_ticks(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void timer_calibrate(timer_calibration_t *cal)
+{
+    static int64_t ticks[overhead_measure];
+    int n = 0;
+    for (int i = 0; i < overhead_measure; i++) {
+        int64_t before = timer_begin();
+        int64_t after = timer_end();
+        if (after - before >= 0)
+            ticks[n++] = after - before;
+    }
+    if (!n) {
+        cal->floor = cal->median = cal->spread = 0;
+        return;
+    }
+
+    qsort(ticks, n, sizeof(int64_t), cmp_ticks);
+    cal->floor = ticks[0];
+    cal->median = ticks[n / 2];
+    cal->spread = ticks[n * 9 / 10] - ticks[n / 10];
+}
+
+double timer_rate_drift(void)
+{
+    int64_t lowest = INT64_MAX, highest = 0;
+    /* The first round only brings the code and the clock up to speed */
+    for (int i = -1; i < drift_rounds; i++) {
+        /* Take the quickest of a few runs, to leave out interrupts */
+        int64_t best = INT64_MAX;
+        for (int j = 0; j < drift_runs; j++) {
+            uint64_t x = i + 1;
+            int64_t before = timer_begin();
+            for (int k = 0; k < drift_work; k++)
+                x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            int64_t after = timer_end();
+            __asm__ volatile("" ::"r"(x));
+            if (after - before < best)
+                best = after - before;
+        }
+        if (i < 0)
+            continue;
+        if (best < lowest)
+            lowest = best;
+        if (best > highest)
+            highest = best;
+    }
+    return lowest > 0 ? (double) (highest - lowest) / lowest : 0;
+}
@@ -0,0 +1,93 @@
+#ifndef DUDECT_TIMER_H
+#define DUDECT_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpucycles.h"
+
+/* Ways of timing a measured operation */
+enum {
+    timer_rdtsc,             /* Bare cycle counter read */
+    timer_fenced,            /* Counter read serialized with fences */
+    timer_perf_cycles,       /* Core cycles from perf_event_open */
+    timer_perf_instructions, /* Retired instructions from perf_event_open */
+    timer_backends,
+};
+
+/* Selected timing backend, one of the values above */
+extern int timer_backend;
+
+/* CPU to run the measurements on, or -1 to leave scheduling alone */
+extern int timer_cpu;
+
+/* Name of a timing backend */
+const char *timer_name(int backend);
+
+/*
+ * Get the selected backend ready and pin the process to timer_cpu.
+ * Return false if either fails; the process is left as it was.
+ */
+bool timer_setup(void);
+
+/* Release the backend and restore the CPU affinity saved by timer_setup */
+void timer_teardown(void);
+
+/* Readings of an empty measured region, i.e. the cost the backend adds to
+ * every measurement
+ */
+typedef struct {
+    int64_t floor;  /* Smallest reading */
+    int64_t median; /* Typical reading */
+    int64_t spread; /* Distance from the 10th to the 90th percentile */
+} timer_calibration_t;
+
+/* Time empty regions with the selected backend.  Call between timer_setup
+ * and timer_teardown.
+ */
+void timer_calibrate(timer_calibration_t *cal);
+
+/*
+ * Time a fixed workload several times, and return by how much the readings
+ * vary relative to the smallest one.  With a cycle counter ticking at a
+ * constant rate, a large variation means the core clock changes under us.
+ */
+double timer_rate_drift(void);
+
+/* Number of CPUs the process may run on */
+int timer_cpu_count(void);
+
+/* CPU for measurement worker number worker to be pinned to, spreading the
+ * workers over the CPUs the process may run on.  Return -1 if unknown.
+ */
+int timer_worker_cpu(int worker);
+
+/* Current value of the perf counter opened by timer_setup */
+int64_t perf_counter_read(void);
+
+static inline int64_t timer_begin(void)
+{
+    switch (timer_backend) {
+    case timer_fenced:
+        return cpucycles_begin();
+    case timer_perf_cycles:
+    case timer_perf_instructions:
+        return perf_counter_read();
+    default:
+        return cpucycles();
+    }
+}
+
+static inline int64_t timer_end(void)
+{
+    switch (timer_backend) {
+    case timer_fenced:
+        return cpucycles_end();
+    case timer_perf_cycles:
+    case timer_perf_instructions:
+        return perf_counter_read();
+    default:
+        return cpucycles();
+    }
+}
+
+#endif
@@ -28,6 +28,23 @@ void t_push(t_ctx *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Chan et al. method for combining the moments of two samples, so that
+ * measurements taken apart end up as if pushed into one context.
+ */
+void t_merge(t_ctx *ctx, const t_ctx *other)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = ctx->n[class] + other->n[class];
+        if (n == 0)
+            continue;
+        double delta = other->mean[class] - ctx->mean[class];
+        ctx->mean[class] += delta * other->n[class] / n;
+        ctx->m2[class] += other->m2[class] +
+                          delta * delta * ctx->n[class] * other->n[class] / n;
+        ctx->n[class] = n;
+    }
+}
+
 double t_compute(t_ctx *ctx)
 {
     double var[2] = {0.0, 0.0};
@@ -48,3 +65,80 @@ void t_init(t_ctx *ctx)
     }
     return;
 }
+
+/* Online update of the central moments, see
+ * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Higher-order_statistics
+ */
+void t_moments_push(t_moments *ctx, double x, uint8_t class)
+{
+    assert(class == 0 || class == 1);
+    double n1 = ctx->n[class];
+    double n = ++ctx->n[class];
+    double delta = x - ctx->mean[class];
+    double delta_n = delta / n;
+    double delta_n2 = delta_n * delta_n;
+    double term1 = delta * delta_n * n1;
+
+    ctx->mean[class] += delta_n;
+    ctx->m4[class] += term1 * delta_n2 * (n * n - 3 * n + 3) +
+                      6 * delta_n2 * ctx->m2[class] -
+                      4 * delta_n * ctx->m3[class];
+    ctx->m3[class] +=
+        term1 * delta_n * (n - 2) - 3 * delta_n * ctx->m2[class];
+    ctx->m2[class] += term1;
+}
+
+/* Pebay's formulas for combining the central moments of two samples */
+void t_moments_merge(t_moments *ctx, const t_moments *other)
+{
+    for (int class = 0; class < 2; class ++) {
+        double na = ctx->n[class], nb = other->n[class];
+        double n = na + nb;
+        if (n == 0)
+            continue;
+        double delta = other->mean[class] - ctx->mean[class];
+        double delta2 = delta * delta;
+        double m2a = ctx->m2[class], m2b = other->m2[class];
+        double m3a = ctx->m3[class], m3b = other->m3[class];
+
+        double nab = na * nb;
+
+        ctx->mean[class] += delta * nb / n;
+        ctx->m4[class] +=
+            other->m4[class] +
+            delta2 * delta2 * nab * (na * na - nab + nb * nb) / (n * n * n) +
+            6 * delta2 * (na * na * m2b + nb * nb * m2a) / (n * n) +
+            4 * delta * (na * m3b - nb * m3a) / n;
+        ctx->m3[class] += m3b + delta2 * delta * nab * (na - nb) / (n * n) +
+                          3 * delta * (na * m2b - nb * m2a) / n;
+        ctx->m2[class] += m2b + delta2 * nab / n;
+        ctx->n[class] = n;
+    }
+}
+
+/*
+ * Set ctx up as the t-test of the squared deviations from the class means,
+ * which compares the variances of the two classes.  With y = (x - mean)^2,
+ * the mean of y is m2 / n and its sum of squared deviations m4 - m2^2 / n.
+ */
+void t_second_order(t_ctx *ctx, const t_moments *moments)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = moments->n[class];
+        double m2 = moments->m2[class];
+        ctx->n[class] = n;
+        ctx->mean[class] = n > 0 ? m2 / n : 0.0;
+        ctx->m2[class] = n > 0 ? moments->m4[class] - m2 * m2 / n : 0.0;
+    }
+}
+
+void t_moments_init(t_moments *ctx)
+{
+    for (int class = 0; class < 2; class ++) {
+        ctx->mean[class] = 0.0;
+        ctx->m2[class] = 0.0;
+        ctx->m3[class] = 0.0;
+        ctx->m4[class] = 0.0;
+        ctx->n[class] = 0.0;
+    }
+}
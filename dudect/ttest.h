@@ -8,8 +8,21 @@ typedef struct {
     double n[2];
 } t_ctx;
 
+/* Central moments up to the fourth, for the second order test */
+typedef struct {
+    double mean[2];
+    double m2[2], m3[2], m4[2];
+    double n[2];
+} t_moments;
+
 void t_push(t_ctx *ctx, double x, uint8_t class);
+void t_merge(t_ctx *ctx, const t_ctx *other);
 double t_compute(t_ctx *ctx);
 void t_init(t_ctx *ctx);
 
+void t_moments_push(t_moments *ctx, double x, uint8_t class);
+void t_moments_merge(t_moments *ctx, const t_moments *other);
+void t_second_order(t_ctx *ctx, const t_moments *moments);
+void t_moments_init(t_moments *ctx);
+
 #endif
@@ -1,12 +1,18 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "prng.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -29,47 +35,265 @@
 
 /* Data structures used by our code */
 
+typedef struct ARENA arena_t;
+
 /*
  * Represent allocated blocks as doubly-linked list, with
  * next and prev pointers at beginning
  */
 typedef struct BELE {
     struct BELE *next, *prev;
-    size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    union {
+        arena_t *owner; /* Arena of the thread that allocated it */
+        /* Once freed by another thread, link in remote free stack of owner */
+        struct BELE *remote_next;
+    };
+    uint32_t payload_size : 31;
+    uint32_t guarded : 1;  /* Mapped by itself against a guard page */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Largest payload the header can describe */
+#define MAX_PAYLOAD ((1UL << 31) - 1)
+
+/* Payloads are found by stepping over a whole header */
+_Static_assert(offsetof(block_ele_t, payload) == sizeof(block_ele_t),
+               "block header must not end in padding");
+/* and must be aligned as well as the memory malloc returns */
+_Static_assert(sizeof(block_ele_t) % _Alignof(max_align_t) == 0,
+               "block header must keep payloads aligned");
+
+/*
+ * Every thread calling into the harness gets its own arena, so the common
+ * path of allocating and freeing never touches shared state.  Only the owner
+ * thread links and unlinks blocks of its list.  A block freed by another
+ * thread is validated and counted right away, then handed back through the
+ * lock-free remote_free stack and unlinked by the owner on its next call.
+ *
+ * Arenas are never released, which keeps walking the registry safe without
+ * any locking.  The arena of an exited thread is adopted by the next new
+ * thread instead, which also releases what was freed into it meanwhile.
+ */
+struct ARENA {
+    block_ele_t *allocated;
+    _Atomic(block_ele_t *) remote_free;
+    atomic_size_t count;  /* Live blocks owned by this arena */
+    atomic_bool orphaned; /* The owner thread has exited */
+    arena_t *next;        /* Next arena in the registry */
+};
+
+static _Atomic(arena_t *) arenas = NULL;
+static __thread arena_t *local_arena = NULL;
+
+/* Marks the arena of a thread as orphaned when the thread exits */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+/* Place one in every guard_interval payloads against a guard page */
+int guard_interval = 0;
+static __thread unsigned int guard_countdown = 0;
+/* Set once mapping a guarded block has failed, e.g. on vm.max_map_count */
+static atomic_bool guard_exhausted = false;
+
+static __thread bool cautious_mode = true;
+static __thread bool noallocate_mode = false;
+
+/* Allocation budget of the operation in progress, if any */
+static __thread const char *budget_op = NULL;
+static __thread size_t budget_max_calls, budget_max_bytes, budget_max_frees;
+static __thread size_t budget_calls, budget_bytes, budget_frees;
+static atomic_bool error_occurred = false;
+static __thread char *error_message = "";
 
 static int time_limit = 1;
 
 /*
- * Data for managing exceptions
+ * Data for managing exceptions.
+ * Each thread has its own context, so a worker thread raising an exception
+ * returns to its own exception_setup.
  */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static __thread sigjmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
 
 /*
  * Internal functions
  */
 
+/* Return arena of calling thread, registering it on first use */
+static void orphan_arena(void *arg)
+{
+    arena_t *a = arg;
+    atomic_store(&a->orphaned, true);
+}
+
+static void make_arena_key()
+{
+    pthread_key_create(&arena_key, orphan_arena);
+}
+
+static arena_t *get_arena()
+{
+    if (local_arena)
+        return local_arena;
+
+    arena_t *a = NULL;
+    for (arena_t *o = atomic_load(&arenas); o && !a; o = o->next) {
+        bool orphaned = true;
+        if (atomic_compare_exchange_strong(&o->orphaned, &orphaned, false))
+            a = o;
+    }
+
+    if (!a) {
+        a = calloc(1, sizeof(arena_t));
+        if (!a) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            return NULL;
+        }
+
+        arena_t *head = atomic_load(&arenas);
+        do {
+            a->next = head;
+        } while (!atomic_compare_exchange_weak(&arenas, &head, a));
+    }
+
+    pthread_once(&arena_key_once, make_arena_key);
+    pthread_setspecific(arena_key, a);
+    local_arena = a;
+    return a;
+}
+
+static size_t page_size()
+{
+    static size_t size = 0;
+    if (!size)
+        size = (size_t) sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/* Block headers start at multiples of this */
+#define HEADER_ALIGN _Alignof(max_align_t)
+
+/*
+ * Map a block so that its payload ends right at an inaccessible page.
+ * Any access past the payload faults at the offending instruction.  The
+ * header is moved down to an aligned address, leaving a gap of less than
+ * HEADER_ALIGN bytes before the payload.  Both ends can therefore be found
+ * by rounding, see find_header and block_payload.  Guarded blocks carry no
+ * footer.
+ */
+static size_t guarded_len(size_t size)
+{
+    size_t page = page_size();
+    size_t used = size + sizeof(block_ele_t) + HEADER_ALIGN - 1;
+    return (used + page - 1) / page * page + page;
+}
+
+static block_ele_t *guarded_alloc(size_t size)
+{
+    size_t page = page_size();
+    size_t len = guarded_len(size);
+    unsigned char *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    unsigned char *guard = base + len - page;
+    if (mprotect(guard, page, PROT_NONE)) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t) (guard - size - sizeof(block_ele_t));
+    block_ele_t *b = (block_ele_t *) (start & ~(uintptr_t) (HEADER_ALIGN - 1));
+    b->guarded = true;
+    return b;
+}
+
+/* The payload ends on the guard page of a guarded block */
+static unsigned char *block_payload(block_ele_t *b)
+{
+    if (!b->guarded)
+        return b->payload;
+    uintptr_t page = page_size();
+    uintptr_t end = (uintptr_t) b->payload + b->payload_size;
+    return (unsigned char *) ((end + page - 1) & ~(page - 1)) - b->payload_size;
+}
+
+/* Should the next allocation be guarded? */
+static bool want_guard()
+{
+    if (guard_interval <= 0)
+        return false;
+    if (guard_countdown == 0 || guard_countdown > (unsigned int) guard_interval)
+        guard_countdown = guard_interval;
+    return --guard_countdown == 0;
+}
+
+/* Give block back to the system */
+static void release_block(block_ele_t *b)
+{
+    if (b->guarded) {
+        unsigned char *guard = block_payload(b) + b->payload_size;
+        size_t len = guarded_len(b->payload_size);
+        munmap(guard + page_size() - len, len);
+    } else {
+        free(b);
+    }
+}
+
+/* Unlink and release the blocks other threads have freed on our behalf */
+static void drain_remote_free(arena_t *a)
+{
+    if (!atomic_load_explicit(&a->remote_free, memory_order_relaxed))
+        return;
+
+    block_ele_t *b = atomic_exchange(&a->remote_free, NULL);
+    while (b) {
+        block_ele_t *next_free = b->remote_next;
+        block_ele_t *bn = b->next;
+        block_ele_t *bp = b->prev;
+        if (bp)
+            bp->next = bn;
+        else
+            a->allocated = bn;
+        if (bn)
+            bn->prev = bp;
+        release_block(b);
+        b = next_free;
+    }
+}
+
+/* Is block b on the list of arena a? Only valid when called by the owner */
+static bool arena_contains(arena_t *a, block_ele_t *b)
+{
+    block_ele_t *ab = a->allocated;
+    bool found = false;
+    while (ab && !found) {
+        found = ab == b;
+        ab = ab->next;
+    }
+    return found;
+}
+
+/* Is a among the registered arenas? */
+static bool arena_registered(arena_t *a)
+{
+    arena_t *r = atomic_load(&arenas);
+    while (r && r != a)
+        r = r->next;
+    return r != NULL;
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return prng_below(prng_threshold(fail_probability));
 }
 
 /*
@@ -83,15 +307,18 @@ static block_ele_t *find_header(void *p)
         error_occurred = true;
     }
 
-    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    /* Rounding down only makes a difference for guarded blocks */
+    block_ele_t *b = (block_ele_t *) (((size_t) p - sizeof(block_ele_t)) &
+                                      ~(size_t) (HEADER_ALIGN - 1));
     if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
+        /* Make sure this is really an allocated block.
+         * Lists of other threads may change under us, so a block owned by
+         * another arena is only checked for a plausible owner, leaving the
+         * rest to the magic number.
+         */
+        arena_t *a = get_arena();
+        bool found = b->owner == a ? arena_contains(a, b)
+                                   : arena_registered(b->owner);
         if (!found) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
@@ -124,18 +351,52 @@ static size_t *find_footer(block_ele_t *b)
  */
 void *test_malloc(size_t size)
 {
+    arena_t *a = get_arena();
+    drain_remote_free(a);
+
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
+    if (budget_op) {
+        budget_calls++;
+        budget_bytes += size;
+        if (budget_calls == budget_max_calls + 1) {
+            report_event(MSG_ERROR, "%s made more than %lu allocations",
+                         budget_op, (unsigned long) budget_max_calls);
+            error_occurred = true;
+        } else if (budget_bytes > budget_max_bytes &&
+                   budget_bytes - size <= budget_max_bytes) {
+            report_event(MSG_ERROR, "%s allocated more than %lu bytes",
+                         budget_op, (unsigned long) budget_max_bytes);
+            error_occurred = true;
+        }
+    }
+
     if (fail_allocation()) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+    block_ele_t *new_block;
+    if (size > MAX_PAYLOAD) {
+        new_block = NULL;
+    } else {
+        new_block = NULL;
+        if (want_guard()) {
+            new_block = guarded_alloc(size);
+            /* Out of mappings is no reason to fail while the heap serves */
+            if (!new_block && !atomic_exchange(&guard_exhausted, true))
+                report_event(MSG_WARN, "Out of guard mappings, "
+                                       "using footer checks instead");
+        }
+        if (!new_block) {
+            new_block = malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+            if (new_block)
+                new_block->guarded = false;
+        }
+    }
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -145,18 +406,21 @@ void *test_malloc(size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
+    if (!new_block->guarded)
+        *find_footer(new_block) = MAGICFOOTER;
+    void *p = (void *) block_payload(new_block);
     memset(p, FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->owner = a;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->next = a->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (a->allocated)
+        a->allocated->prev = new_block;
+    a->allocated = new_block;
+    atomic_fetch_add_explicit(&a->count, 1, memory_order_relaxed);
 
     return p;
 }
@@ -183,31 +447,58 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (budget_op) {
+        budget_frees++;
+        if (budget_frees > budget_calls &&
+            budget_frees - budget_calls == budget_max_frees + 1) {
+            report_event(MSG_ERROR,
+                         "%s freed more than %lu blocks it did not allocate",
+                         budget_op, (unsigned long) budget_max_frees);
+            error_occurred = true;
+        }
+    }
+
+    arena_t *a = get_arena();
+    drain_remote_free(a);
+
     block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    if (!b->guarded) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
+    arena_t *owner = b->owner;
+    atomic_fetch_sub_explicit(&owner->count, 1, memory_order_relaxed);
+
+    if (owner != a) {
+        /* Only the owner may touch its list */
+        block_ele_t *head = atomic_load(&owner->remote_free);
+        do {
+            b->remote_next = head;
+        } while (!atomic_compare_exchange_weak(&owner->remote_free, &head, b));
+        return;
+    }
+
     /* Unlink from list */
     block_ele_t *bn = b->next;
     block_ele_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        a->allocated = bn;
     if (bn)
         bn->prev = bp;
 
-    free(b);
-    allocated_count--;
+    release_block(b);
 }
 
 // cppcheck-suppress unusedFunction
@@ -221,15 +512,54 @@ char *test_strdup(const char *s)
     return (char *) memcpy(new, s, len);
 }
 
+/*
+ * Merge the per-thread counts.  Blocks freed by another thread are already
+ * deducted from their owner's count, so the sum is exact once the other
+ * threads are quiescent.
+ */
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t cnt = 0;
+    for (arena_t *a = atomic_load(&arenas); a; a = a->next)
+        cnt += atomic_load_explicit(&a->count, memory_order_relaxed);
+    return cnt;
 }
 
 /*
  * Implementation of functions for testing
  */
 
+/*
+ * Look for a guarded block whose guard page contains addr.
+ * Meant to be called from a SIGSEGV handler, when the program is about to
+ * abort anyway, so the lists of other threads are walked without care.
+ */
+bool report_guard_fault(void *addr)
+{
+    unsigned char *fault = addr;
+    size_t page = page_size();
+    for (arena_t *a = atomic_load(&arenas); a; a = a->next) {
+        for (block_ele_t *b = a->allocated; b; b = b->next) {
+            if (!b->guarded || b->magic_header != MAGICHEADER)
+                continue;
+            unsigned char *payload = block_payload(b);
+            unsigned char *guard = payload + b->payload_size;
+            if (fault < guard || fault >= guard + page)
+                continue;
+
+            int shown = b->payload_size < 32 ? (int) b->payload_size : 32;
+            report(1,
+                   "Access %lu byte(s) past the end of %lu-byte block at %p "
+                   "(contents \"%.*s\")",
+                   (unsigned long) (fault - guard),
+                   (unsigned long) b->payload_size, (void *) payload, shown,
+                   (char *) payload);
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -248,14 +578,39 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/*
+ * Start counting calls to malloc and free against a budget for operation op.
+ * The first allocation beyond max_calls or max_bytes is reported as an error,
+ * as is the first free beyond the allocations so far plus max_frees.
+ */
+void alloc_budget_begin(const char *op,
+                        size_t max_calls,
+                        size_t max_bytes,
+                        size_t max_frees)
+{
+    budget_op = op;
+    budget_max_calls = max_calls;
+    budget_max_bytes = max_bytes;
+    budget_max_frees = max_frees;
+    budget_calls = 0;
+    budget_bytes = 0;
+    budget_frees = 0;
+}
+
+/*
+ * Stop counting allocations against the budget
+ */
+void alloc_budget_end()
+{
+    budget_op = NULL;
+}
+
 /*
  * Return whether any errors have occurred since last time set error limit
  */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /*
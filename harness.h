@@ -9,6 +9,9 @@
  * This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The allocation functions may be called from several threads at once, and
+ * a block may be freed by a thread other than the one that allocated it.
  */
 
 void *test_malloc(size_t size);
@@ -19,32 +22,63 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/*
+ * Report number of allocated blocks, summed over all threads.
+ * Exact only while no other thread is allocating or freeing.
+ */
 size_t allocation_check();
 
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
 /*
- * Set/unset cautious mode.
+ * Place the payload of one in every guard_interval allocations right
+ * against an inaccessible page, so that overflows fault immediately.
+ * 0 disables guard pages, 1 guards every allocation.
+ */
+extern int guard_interval;
+
+/*
+ * Report the guarded block that addr overflowed, if any.
+ * Return true if addr lies within a guard page.
+ */
+bool report_guard_fault(void *addr);
+
+/*
+ * Set/unset cautious mode for the calling thread.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
 /*
- * Set/unset restricted allocation mode.
+ * Set/unset restricted allocation mode for the calling thread.
  * In this mode, calls to malloc and free are disallowed.
  */
 void set_noallocate_mode(bool noallocate);
 
 /*
-  Return whether any errors have occurred since last time checked
+ * Limit the calls to malloc and free the calling thread makes on behalf of
+ * operation op, until alloc_budget_end() is called.  The first allocation
+ * exceeding max_calls calls or max_bytes bytes in total is reported as an
+ * error naming op.  So is the first free beyond max_frees more than the
+ * allocations made so far, which lets op release its own scratch memory.
+ */
+void alloc_budget_begin(const char *op,
+                        size_t max_calls,
+                        size_t max_bytes,
+                        size_t max_frees);
+void alloc_budget_end();
+
+/*
+  Return whether any errors have occurred in any thread since last time checked
  */
 bool error_check();
 
 /*
  * Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Function returns true for initial return, false for error return.
+ * Each thread has its own exception context.  The time limit relies on
+ * alarm(), so only one thread at a time should ask for it.
  */
 bool exception_setup(bool limit_time);
 
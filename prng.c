@@ -0,0 +1,92 @@
+/*
+ * xoshiro256** by David Blackman and Sebastiano Vigna, seeded through
+ * splitmix64 as recommended by the authors.
+ * See https://prng.di.unimi.it/
+ */
+
+#include "prng.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+static uint64_t base_seed = 0x9e3779b97f4a7c15;
+static atomic_uint_fast64_t stream_cnt = 0;
+
+static __thread uint64_t state[4];
+static __thread bool seeded = false;
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static void seed_state(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        state[i] = splitmix64(&seed);
+    seeded = true;
+}
+
+void prng_seed(uint64_t seed)
+{
+    base_seed = seed;
+    seed_state(seed);
+}
+
+uint64_t prng_next(void)
+{
+    if (!seeded) {
+        uint64_t stream = atomic_fetch_add(&stream_cnt, 1) + 1;
+        seed_state(base_seed ^ (stream * 0xd1342543de82ef95));
+    }
+
+    const uint64_t result = rotl(state[1] * 5, 7) * 9;
+    const uint64_t t = state[1] << 17;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+
+    return result;
+}
+
+/*
+ * Map 32 random bits onto [0, n) with a multiplication instead of a
+ * division.  The bias is below n / 2^32, negligible for our ranges.
+ * See https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+ */
+uint32_t prng_bounded(uint32_t n)
+{
+    return (uint32_t) (((prng_next() >> 32) * (uint64_t) n) >> 32);
+}
+
+void prng_fill_string(char *buf,
+                      size_t buf_size,
+                      size_t min_len,
+                      const char *charset,
+                      size_t charset_len)
+{
+    /* Room is needed for min_len characters and the terminator */
+    assert(buf_size > min_len);
+    size_t len = min_len + prng_bounded(buf_size - min_len);
+
+    for (size_t n = 0; n < len; n += 8) {
+        uint64_t r = prng_next();
+        size_t end = len - n < 8 ? len - n : 8;
+        /* Scale each byte of r onto the charset */
+        for (size_t i = 0; i < end; i++, r >>= 8)
+            buf[n + i] = charset[((r & 0xff) * charset_len) >> 8];
+    }
+    buf[len] = '\0';
+}
@@ -0,0 +1,55 @@
+#ifndef LAB0_PRNG_H
+#define LAB0_PRNG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast, seedable pseudo-random number generator (xoshiro256**).
+ * Same seed gives the same sequence, which makes failing traces
+ * reproducible.  Not suitable where unpredictability matters; use
+ * randombytes() for that.
+ *
+ * Each thread owns a generator.  Threads that never call prng_seed()
+ * derive a distinct stream from the last seed given.
+ */
+
+/* Seed the generator of the calling thread */
+void prng_seed(uint64_t seed);
+
+/* Return next 64 random bits */
+uint64_t prng_next(void);
+
+/* Return random integer in range [0, n) */
+uint32_t prng_bounded(uint32_t n);
+
+/* Convert a probability in percent into a threshold for prng_below */
+static inline uint64_t prng_threshold(int percent)
+{
+    if (percent <= 0)
+        return 0;
+    if (percent >= 100)
+        return UINT64_MAX;
+    return (uint64_t) percent * (UINT64_MAX / 100);
+}
+
+/* Return true with probability threshold / 2^64 */
+static inline bool prng_below(uint64_t threshold)
+{
+    return threshold && prng_next() < threshold;
+}
+
+/*
+ * Fill buf with a random string of at least min_len and at most
+ * buf_size - 1 characters drawn from charset, then terminate it.
+ * buf_size must be larger than min_len.  Eight characters are produced
+ * from every 64-bit draw.
+ */
+void prng_fill_string(char *buf,
+                      size_t buf_size,
+                      size_t min_len,
+                      const char *charset,
+                      size_t charset_len);
+
+#endif /* LAB0_PRNG_H */
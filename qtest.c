@@ -2,17 +2,24 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp */
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include "dudect/fixture.h"
+#include "dudect/timer.h"
 #include "list.h"
 
 /* Our program needs to use regular malloc/free */
@@ -34,6 +41,7 @@
 #include "queue.h"
 
 #include "console.h"
+#include "prng.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -69,10 +77,42 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Most threads the mt command may start */
+#define MT_MAX_THREADS 64
+
+/* Serializes the operations on the shared queue of the threads started by
+ * mt, and holds them back until all have been started
+ */
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mt_gate = PTHREAD_COND_INITIALIZER;
+static bool mt_open = false;
+static pthread_barrier_t mt_barrier;
+
+/* Seed of pseudo-random numbers, settable to reproduce a run */
+static int seed = 0;
+
+/* Queue sizes and runs per size timed by the bench command */
+#define BENCH_SIZES 6
+#define BENCH_TRIALS 5
+
+/* 97.5% quantile of Student's t distribution, BENCH_SIZES - 2 degrees */
+#define BENCH_T_975 2.776
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+_Static_assert(MAX_RANDSTR_LEN > MIN_RANDSTR_LEN,
+               "random strings need room for the terminator");
+
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/*
+ * Allocation budgets of queue operations.
+ * Inserting an element may take one block for the element and one for
+ * its string.  Sorting may use scratch space logarithmic in queue size.
+ */
+#define INSERT_ALLOCS 2
+#define SORT_SCRATCH_PER_LEVEL 64
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
@@ -90,9 +130,11 @@ static bool do_free(int argc, char *argv[])
 
     if (lcnt > big_list_size)
         set_cautious_mode(false);
+    alloc_budget_begin(argv[0], 0, 0, SIZE_MAX);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
+    alloc_budget_end();
     set_cautious_mode(true);
 
     l_meta.size = 0;
@@ -124,31 +166,45 @@ static bool do_new(int argc, char *argv[])
     }
     error_check();
 
+    alloc_budget_begin(argv[0], 1, SIZE_MAX, 0);
     if (exception_setup(true)) {
         l_meta.l = q_new();
         l_meta.size = 0;
     }
     exception_cancel();
+    alloc_budget_end();
     lcnt = 0;
     show_queue(3);
 
     return ok && !error_check();
 }
 
-/*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
- */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    prng_fill_string(buf, buf_size, MIN_RANDSTR_LEN, charset,
+                     sizeof charset - 1);
+}
+
+/* In simulation mode, check how the running time of an operation grows */
+static bool simulate_complexity(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
 
-    for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+    complexity_t expected, found;
+    if (!estimate_complexity(argv[0], &expected, &found)) {
+        report(1, "ERROR: Could not measure %s", argv[0]);
+        return false;
+    }
+    if (found > expected) {
+        report(1, "ERROR: Probably %s, expected %s", complexity_name(found),
+               complexity_name(expected));
+        return false;
     }
-    buf[len] = '\0';
+    report(1, "Probably %s", complexity_name(found));
+    return true;
 }
 
 /* insert head */
@@ -189,11 +245,14 @@ static bool do_ih(int argc, char *argv[])
         need_rand = true;
         inserts = randstr_buf;
     }
+    size_t slen = need_rand ? sizeof(randstr_buf) : strlen(inserts) + 1;
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    alloc_budget_begin(argv[0], (size_t) reps * INSERT_ALLOCS,
+                       (size_t) reps * (sizeof(element_t) + slen), 0);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -236,6 +295,7 @@ static bool do_ih(int argc, char *argv[])
         }
     }
     exception_cancel();
+    alloc_budget_end();
 
     show_queue(3);
     return ok;
@@ -278,11 +338,14 @@ static bool do_it(int argc, char *argv[])
         need_rand = true;
         inserts = randstr_buf;
     }
+    size_t slen = need_rand ? sizeof(randstr_buf) : strlen(inserts) + 1;
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    alloc_budget_begin(argv[0], (size_t) reps * INSERT_ALLOCS,
+                       (size_t) reps * (sizeof(element_t) + slen), 0);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -312,10 +375,239 @@ static bool do_it(int argc, char *argv[])
         }
     }
     exception_cancel();
+    alloc_budget_end();
     show_queue(3);
     return ok;
 }
 
+/* Work of one thread inserting for mt */
+typedef struct MT_ARG {
+    char *inserts;
+    int reps;
+    int inserted;
+    struct list_head *own; /* Queue the thread builds for its neighbour */
+    int own_size;
+    bool own_ok; /* The queue of the previous thread was intact */
+    struct MT_ARG *next;
+} mt_arg_t;
+
+static void *mt_insert(void *arg)
+{
+    mt_arg_t *m = arg;
+    pthread_mutex_lock(&mt_lock);
+    while (!mt_open)
+        pthread_cond_wait(&mt_gate, &mt_lock);
+    pthread_mutex_unlock(&mt_lock);
+
+    /* All threads allocate at once, each for a queue of its own */
+    m->own = q_new();
+    for (int r = 0; r < m->reps; r++)
+        m->own_size += q_insert_tail(m->own, m->inserts);
+    pthread_barrier_wait(&mt_barrier);
+
+    /* and free the queue of the next one while its owner is still alive */
+    mt_arg_t *next = (mt_arg_t *) m->next;
+    next->own_ok = q_size(next->own) == next->own_size;
+    q_free(next->own);
+    pthread_barrier_wait(&mt_barrier);
+
+    /* The owners take their freed blocks back on their next allocation */
+    for (int r = 0; r < m->reps; r++) {
+        pthread_mutex_lock(&mt_lock);
+        bool rval = q_insert_tail(l_meta.l, m->inserts);
+        pthread_mutex_unlock(&mt_lock);
+        if (rval)
+            m->inserted++;
+    }
+    return NULL;
+}
+
+/*
+ * insert tail from several threads.  Each thread first builds a queue of its
+ * own and frees that of another, all at once, to exercise the harness with
+ * concurrent allocations and frees across threads.
+ */
+static bool do_mt(int argc, char *argv[])
+{
+    int reps = 1, threads = 2;
+    if (argc < 2 || argc > 4 || (argc > 2 && !get_int(argv[2], &reps)) ||
+        (argc > 3 && !get_int(argv[3], &threads)) || threads < 1 ||
+        threads > MT_MAX_THREADS) {
+        report(1, "%s needs a string, [n] and [threads] of at most %d",
+               argv[0], MT_MAX_THREADS);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling insert tail on null queue");
+    error_check();
+
+    /* The time limit could not stop the other threads, so leave it off and
+     * keep SIGALRM away from them
+     */
+    sigset_t alrm, saved_mask;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &saved_mask);
+
+    pthread_t tid[MT_MAX_THREADS];
+    mt_arg_t work[MT_MAX_THREADS];
+    int started = 0;
+    for (; started < threads; started++) {
+        work[started] = (mt_arg_t){.inserts = argv[1], .reps = reps};
+        if (pthread_create(&tid[started], NULL, mt_insert, &work[started]))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+    /* Let the threads go, in a ring of the ones that could be started */
+    if (started > 0) {
+        for (int t = 0; t < started; t++)
+            work[t].next = &work[(t + 1) % started];
+        pthread_barrier_init(&mt_barrier, NULL, started);
+        pthread_mutex_lock(&mt_lock);
+        mt_open = true;
+        pthread_cond_broadcast(&mt_gate);
+        pthread_mutex_unlock(&mt_lock);
+    }
+
+    bool ok = true;
+    int inserted = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(tid[t], NULL);
+        inserted += work[t].inserted;
+        if (!work[t].own_ok) {
+            report(1, "ERROR: Queue built by thread %d was not intact", t);
+            ok = false;
+        }
+    }
+    if (started > 0)
+        pthread_barrier_destroy(&mt_barrier);
+    mt_open = false;
+    lcnt += inserted;
+    l_meta.size += inserted;
+
+    if (started < threads) {
+        report(1, "ERROR: Could only start %d threads", started);
+        ok = false;
+    }
+    if (inserted < started * reps) {
+        fail_count += started * reps - inserted;
+        if (fail_count < fail_limit) {
+            report(2, "Insertion of %s failed", argv[1]);
+        } else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   argv[1], fail_count);
+            ok = false;
+        }
+    }
+    show_queue(3);
+    return ok && !error_check();
+}
+
+#ifdef __linux__
+#define PIPES_MAX 64
+
+/* Read ends of the pipes of the pipes command, -1 once drained */
+static struct {
+    int fd[PIPES_MAX];
+    int n;
+    int live;
+    size_t bytes;
+} pipes;
+
+static void pipe_drain(int fd)
+{
+    char buf[64];
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) > 0)
+        pipes.bytes += got;
+    for (int i = 0; i < pipes.n; i++) {
+        if (pipes.fd[i] == fd) {
+            cmd_epoll_del(fd);
+            close(fd);
+            pipes.fd[i] = -1;
+            pipes.live--;
+        }
+    }
+}
+
+/* Take a pipe and another one, whose event may be pending in the same wait */
+static void pipe_ready(int fd, uint32_t events, void *arg)
+{
+    pipe_drain(fd);
+    for (int i = 0; i < pipes.n; i++) {
+        if (pipes.fd[i] >= 0) {
+            pipe_drain(pipes.fd[i]);
+            break;
+        }
+    }
+}
+
+/*
+ * Check the callbacks of the epoll event loop on pipes that each hold a
+ * line, where each callback removes its own descriptor and another ready one
+ */
+static bool do_pipes(int argc, char *argv[])
+{
+    int n = 2;
+    if (argc > 2 || (argc > 1 && !get_int(argv[1], &n)) || n < 1 ||
+        n > PIPES_MAX) {
+        report(1, "%s takes [n] of at most %d", argv[0], PIPES_MAX);
+        return false;
+    }
+
+    bool ok = true;
+    size_t expected = 0;
+    pipes.n = pipes.live = 0;
+    pipes.bytes = 0;
+    for (; pipes.n < n; pipes.n++) {
+        int p[2];
+        if (pipe(p) < 0) {
+            report(1, "ERROR: Could not create pipe");
+            ok = false;
+            break;
+        }
+        char line[32];
+        int len = snprintf(line, sizeof(line), "pipe %d\n", pipes.n);
+        if (write(p[1], line, len) == len)
+            expected += len;
+        close(p[1]);
+        if (!cmd_epoll_add(p[0], EPOLLIN, pipe_ready, NULL)) {
+            report(1, "ERROR: %s needs the epoll event loop (--epoll)",
+                   argv[0]);
+            close(p[0]);
+            ok = false;
+            break;
+        }
+        pipes.fd[pipes.n] = p[0];
+        pipes.live++;
+    }
+
+    /* Every pipe is ready, so each wait takes at least one */
+    for (int round = 0; pipes.live > 0 && round < n; round++) {
+        if (cmd_epoll_wait(1000) <= 0)
+            break;
+    }
+    if (pipes.live > 0) {
+        report(1, "ERROR: %d pipes were left unread", pipes.live);
+        for (int i = 0; i < pipes.n; i++) {
+            if (pipes.fd[i] >= 0)
+                pipe_drain(pipes.fd[i]);
+        }
+        ok = false;
+    }
+    if (ok && pipes.bytes != expected) {
+        report(1, "ERROR: Read %lu bytes out of %lu from pipes",
+               (unsigned long) pipes.bytes, (unsigned long) expected);
+        ok = false;
+    }
+    if (ok)
+        report(1, "Read %d pipes", n);
+    return ok;
+}
+#endif
+
 static bool do_remove(int option, int argc, char *argv[])
 {
     // option 0 is for remove head; option 1 is for remove tail
@@ -376,10 +668,12 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
+    alloc_budget_begin(argv[0], 0, 0, 0);
     if (exception_setup(true))
         re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
                     : q_remove_head(l_meta.l, removes, string_length + 1);
     exception_cancel();
+    alloc_budget_end();
 
     bool is_null = re ? false : true;
 
@@ -460,9 +754,11 @@ static bool do_rhq(int argc, char *argv[])
 
     element_t *re = NULL;
 
+    alloc_budget_begin(argv[0], 0, 0, 0);
     if (exception_setup(true))
         re = q_remove_head(l_meta.l, NULL, 0);
     exception_cancel();
+    alloc_budget_end();
 
     if (re) {
         // q_remove_head and q_remove_tail are not responsible for releasing
@@ -488,18 +784,21 @@ static bool do_rhq(int argc, char *argv[])
 
 static bool do_dedup(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
+    /* Each deleted element frees its string and itself */
     bool ok = true;
-    // set_noallocate_mode(true);
+    alloc_budget_begin(argv[0], 0, 0, (size_t) 2 * l_meta.size);
     if (exception_setup(true))
         ok = q_delete_dup(l_meta.l);
     exception_cancel();
-
-    // set_noallocate_mode(false);
+    alloc_budget_end();
 
     if (!ok) {
         report(1, "ERROR: Calling delete duplicate on null queue");
@@ -529,6 +828,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -550,6 +852,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -573,6 +878,7 @@ static bool do_size(int argc, char *argv[])
         report(3, "Warning: Calling size on null queue");
     error_check();
 
+    alloc_budget_begin(argv[0], 0, 0, 0);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             cnt = q_size(l_meta.l);
@@ -580,6 +886,7 @@ static bool do_size(int argc, char *argv[])
         }
     }
     exception_cancel();
+    alloc_budget_end();
 
     if (ok) {
         if (lcnt == cnt) {
@@ -599,6 +906,9 @@ static bool do_size(int argc, char *argv[])
 
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -613,11 +923,15 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
+    size_t levels = 1;
+    for (int n = cnt; n > 1; n >>= 1)
+        levels++;
+    /* Scratch memory may be freed again, but not the elements */
+    alloc_budget_begin(argv[0], levels, levels * SORT_SCRATCH_PER_LEVEL, 0);
     if (exception_setup(true))
         q_sort(l_meta.l);
     exception_cancel();
-    set_noallocate_mode(false);
+    alloc_budget_end();
 
     bool ok = true;
     if (l_meta.size) {
@@ -642,6 +956,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -651,10 +968,13 @@ static bool do_dm(int argc, char *argv[])
         report(3, "Warning: Try to access null queue");
     error_check();
 
+    /* The middle element frees its string and itself */
     bool ok = true;
+    alloc_budget_begin(argv[0], 0, 0, 2);
     if (exception_setup(true))
         ok = q_delete_mid(l_meta.l);
     exception_cancel();
+    alloc_budget_end();
 
     show_queue(3);
     return ok && !error_check();
@@ -662,6 +982,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -698,7 +1021,7 @@ void q_shuffle(struct list_head *head)
     int count = list_entry(head, q_head, list)->count;
     struct list_head *last = head->prev;
     for (; count > 1; count--) {
-        int need_change = rand() % count;
+        int need_change = prng_bounded(count);
         struct list_head *ptr = head->next;
         for (; need_change > 0; need_change--) {
             ptr = ptr->next;
@@ -733,6 +1056,115 @@ static bool do_shuffle(int argc, char *argv[])
     show_queue(3);
     return !error_check();
 }
+
+static bool do_export(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!set_export_file(argc == 2 ? argv[1] : NULL)) {
+        report(1, "Couldn't open export file '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+/* Build a queue of n random strings through the regular commands */
+static bool bench_fill(int n)
+{
+    char count[16];
+    snprintf(count, sizeof(count), "%d", n);
+    char *new_argv[] = {"new"};
+    char *it_argv[] = {"it", "RAND", count};
+    return interpret_cmda(1, new_argv) && interpret_cmda(3, it_argv);
+}
+
+static int cmp_cycles(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time a command on queues growing geometrically up to max_size elements,
+ * and fit log(cycles) = a + b * log(n).  The slope b estimates the exponent
+ * of the running time.
+ */
+static bool do_bench(int argc, char *argv[])
+{
+    int max_size;
+    if (argc < 3 || !get_int(argv[1], &max_size) ||
+        max_size < (1 << (BENCH_SIZES - 1))) {
+        report(1, "%s needs a size of at least %d and a command", argv[0],
+               1 << (BENCH_SIZES - 1));
+        return false;
+    }
+
+    /* Quitting frees the arguments, so keep the name for the report */
+    char name[32];
+    snprintf(name, sizeof(name), "%s", argv[2]);
+
+    /* Keep the command from printing the queue every time */
+    int saved_verblevel = verblevel;
+    if (verblevel > 1)
+        set_verblevel(1);
+
+    bool ok = true;
+    double x[BENCH_SIZES], y[BENCH_SIZES];
+    int64_t cycles[BENCH_TRIALS];
+    for (int i = 0; i < BENCH_SIZES; i++) {
+        int n = max_size >> (BENCH_SIZES - 1 - i);
+        for (int j = 0; j < BENCH_TRIALS && ok; j++) {
+            ok = bench_fill(n);
+            int64_t before = cpucycles();
+            ok = ok && interpret_cmda(argc - 2, argv + 2);
+            cycles[j] = cpucycles() - before;
+            /* Everything, including argv, is gone after a quit */
+            if (cmd_quit_given()) {
+                set_verblevel(saved_verblevel);
+                report(1, "ERROR: %s ended the session while benchmarking",
+                       name);
+                return false;
+            }
+        }
+        if (!ok)
+            break;
+        qsort(cycles, BENCH_TRIALS, sizeof(int64_t), cmp_cycles);
+        x[i] = log(n);
+        y[i] = log(cycles[BENCH_TRIALS / 2] > 0 ? cycles[BENCH_TRIALS / 2] : 1);
+        report(1, "n = %d: %lld cycles", n,
+               (long long) cycles[BENCH_TRIALS / 2]);
+    }
+    set_verblevel(saved_verblevel);
+    if (!ok) {
+        report(1, "ERROR: %s failed while benchmarking", name);
+        return false;
+    }
+
+    double mean_x = 0, mean_y = 0;
+    for (int i = 0; i < BENCH_SIZES; i++) {
+        mean_x += x[i] / BENCH_SIZES;
+        mean_y += y[i] / BENCH_SIZES;
+    }
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < BENCH_SIZES; i++) {
+        sxx += (x[i] - mean_x) * (x[i] - mean_x);
+        sxy += (x[i] - mean_x) * (y[i] - mean_y);
+    }
+    double slope = sxy / sxx;
+    double sse = 0;
+    for (int i = 0; i < BENCH_SIZES; i++) {
+        double res = y[i] - mean_y - slope * (x[i] - mean_x);
+        sse += res * res;
+    }
+    double stderr_slope = sqrt(sse / (BENCH_SIZES - 2) / sxx);
+    report(1, "Estimated exponent %.2f +/- %.2f (95%% confidence)", slope,
+           BENCH_T_975 * stderr_slope);
+    return true;
+}
+
 static bool is_circular()
 {
     struct list_head *cur = l_meta.l->next;
@@ -813,6 +1245,66 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
+/* Restart all random sequences from the new seed */
+static void seed_changed(int oldval)
+{
+    prng_seed((uint64_t) (unsigned int) seed);
+    srand((unsigned int) seed);
+}
+
+/* Check the new timing setup can be used, and report what it costs */
+static void timer_changed(int oldval)
+{
+    if (timer_backend < 0 || timer_backend >= timer_backends) {
+        report(1, "Timer must be between 0 and %d", timer_backends - 1);
+        timer_backend = oldval;
+        return;
+    }
+    if (!timer_setup()) {
+        timer_backend = oldval;
+        return;
+    }
+    timer_calibration_t cal;
+    timer_calibrate(&cal);
+    report(1, "Timer %s: overhead floor %lld, median %lld, spread %lld",
+           timer_name(timer_backend), (long long) cal.floor,
+           (long long) cal.median, (long long) cal.spread);
+    timer_teardown();
+}
+
+static void cpu_changed(int oldval)
+{
+    if (!timer_setup()) {
+        timer_cpu = oldval;
+        return;
+    }
+    timer_teardown();
+}
+
+static void batch_changed(int oldval)
+{
+    if (batch_size < min_batch_size()) {
+        report(1, "Batch must hold at least %d measurements", min_batch_size());
+        batch_size = oldval;
+    }
+}
+
+static void workers_changed(int oldval)
+{
+    if (worker_count < 0) {
+        report(1, "Workers must not be negative");
+        worker_count = oldval;
+    }
+}
+
+static void cache_changed(int oldval)
+{
+    if (cache_mode < 0 || cache_mode >= cache_modes) {
+        report(1, "Cache must be between 0 and %d", cache_modes - 1);
+        cache_mode = oldval;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "                | Create new queue");
@@ -825,6 +1317,10 @@ static void console_init()
         it,
         " str [n]        | Insert string str at tail of queue n times. "
         "Generate random string(s) if str equals RAND. (default: n == 1)");
+    ADD_COMMAND(mt,
+                " str [n] [t]    | Insert string str at tail of queue n times "
+                "from each of t threads, after they swap private queues. "
+                "(default: n == 1, t == 2)");
     ADD_COMMAND(
         rh,
         " [str]          | Remove from head of queue.  Optionally compare "
@@ -848,20 +1344,63 @@ static void console_init()
                 "                | Swap every two adjacent nodes in queue");
     ADD_COMMAND(shuffle,
                 "                | Random shuufle node value in queue");
+    ADD_COMMAND(export,
+                " [file]         | Write raw dudect timings to file as CSV "
+                "(none: stop)");
+    ADD_COMMAND(bench,
+                " n cmd [args]   | Estimate how cmd scales on queues of up to "
+                "n random strings");
+#ifdef __linux__
+    ADD_COMMAND(pipes,
+                " [n]            | Read n pipes through the epoll event loop "
+                "(default: n == 2)");
+#endif
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("guard", &guard_interval,
+              "Guard one in every n allocations with a page (0: off). "
+              "Guarded payloads end at the page, so are not max_align_t "
+              "aligned",
+              NULL);
+    add_param("seed", &seed, "Seed of random strings and malloc failures",
+              seed_changed);
+    add_param("timer", &timer_backend,
+              "Dudect timer (0: rdtsc, 1: fenced rdtsc, 2: perf cycles, 3: "
+              "perf instructions)",
+              timer_changed);
+    add_param("cpu", &timer_cpu, "CPU to pin dudect measurements to (-1: off)",
+              cpu_changed);
+    add_param("batch", &batch_size, "Number of dudect measurements per batch",
+              batch_changed);
+    add_param("pool", &pool_fixture,
+              "Reuse dudect queues between measurements (0: rebuild each time)",
+              NULL);
+    add_param("cache", &cache_mode,
+              "Dudect cache state (0: as left, 1: warm, 2: cold, 3: both "
+              "reported separately)",
+              cache_changed);
+    add_param("workers", &worker_count,
+              "Number of dudect measurement processes (0: one per CPU)",
+              workers_changed);
 }
 
 /* Signal handlers */
-static void sigsegvhandler(int sig)
+static void sigsegvhandler(int sig, siginfo_t *info, void *ucontext)
 {
-    report(1,
-           "Segmentation fault occurred.  You dereferenced a NULL or invalid "
-           "pointer");
+    if (report_guard_fault(info->si_addr))
+        report(1,
+               "Segmentation fault occurred.  You accessed memory beyond an "
+               "allocated block");
+    else
+        report(1,
+               "Segmentation fault occurred.  You dereferenced a NULL or "
+               "invalid pointer");
+    /* abort() does not flush stdio, so push out the buffered report first */
+    report_flush();
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -877,7 +1416,11 @@ static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
-    signal(SIGSEGV, sigsegvhandler);
+
+    struct sigaction sa = {.sa_sigaction = sigsegvhandler,
+                           .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrmhandler);
 }
 
@@ -904,14 +1447,40 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][--epoll]\n", cmd);
+    printf("       %s --compile IFILE -o OFILE\n", cmd);
     printf("\t-h         Print this information\n");
-    printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-f IFILE   Read commands from IFILE, plain or compiled\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+#ifdef __linux__
+    printf("\t--epoll    Read commands through the epoll event loop\n");
+#endif
+    printf("\t--compile IFILE -o OFILE\n");
+    printf("\t           Compile the commands in IFILE into OFILE\n");
     exit(0);
 }
 
+#ifdef __linux__
+/* Like run_console, but waiting for input with cmd_epoll_wait */
+static bool run_epoll(char *infile_name)
+{
+    if (!cmd_epoll_open(infile_name))
+        return false;
+
+    bool ok = true;
+    while (ok && !cmd_done()) {
+        /* The time limit interrupts the wait with SIGALRM */
+        if (cmd_epoll_wait(-1) < 0 && errno != EINTR) {
+            report(1, "ERROR: Could not wait for input");
+            ok = false;
+        }
+    }
+    cmd_epoll_close();
+    return ok;
+}
+#endif
+
 #define GIT_HOOK ".git/hooks/"
 static bool sanity_check()
 {
@@ -957,10 +1526,21 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *compile_name = NULL;
+    char *output_name = NULL;
     int level = 4;
+    bool use_epoll = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    static const struct option long_options[] = {
+        {"compile", required_argument, NULL, 'c'},
+#ifdef __linux__
+        {"epoll", no_argument, NULL, 'e'},
+#endif
+        {NULL, 0, NULL, 0},
+    };
+    while ((c = getopt_long(argc, argv, "hv:f:l:o:", long_options, NULL)) !=
+           -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -985,6 +1565,15 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'c':
+            compile_name = optarg;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'e':
+            use_epoll = true;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -992,11 +1581,22 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    if (!compile_name != !output_name) {
+        fprintf(stderr, "--compile and -o must be given together\n");
+        exit(EXIT_FAILURE);
+    }
+
+    seed = (int) time(NULL);
+    seed_changed(0);
     queue_init();
     init_cmd();
     console_init();
 
+    if (compile_name) {
+        set_verblevel(level);
+        return compile_trace(compile_name, output_name) ? 0 : 1;
+    }
+
     /* Trigger call back function(auto completion) */
     linenoiseSetCompletionCallback(completion);
 
@@ -1012,7 +1612,12 @@ int main(int argc, char *argv[])
     add_quit_helper(queue_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+#ifdef __linux__
+    if (use_epoll)
+        ok = ok && run_epoll(infile_name);
+    else
+#endif
+        ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
 
     return ok ? 0 : 1;
@@ -1,18 +1,99 @@
 #include "random.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+/*
+ * ChaCha20 keystream generator as specified in RFC 8439.
+ * The key comes from the kernel; blocks are produced on demand into a
+ * buffer that serves subsequent calls.
+ */
+
+#define CHACHA_BLOCK 64
+#define BUF_BLOCKS 16
+
+static uint32_t chacha_state[16];
+static uint8_t buf[CHACHA_BLOCK * BUF_BLOCKS];
+static size_t buf_left = 0;
+static bool keyed = false;
+
+static uint64_t bit_cache;
+static int bits_left = 0;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+static void chacha_block(uint8_t *out)
+{
+    uint32_t x[16];
+    memcpy(x, chacha_state, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + chacha_state[i];
+        out[4 * i] = (uint8_t) v;
+        out[4 * i + 1] = (uint8_t) (v >> 8);
+        out[4 * i + 2] = (uint8_t) (v >> 16);
+        out[4 * i + 3] = (uint8_t) (v >> 24);
+    }
+
+    /* Block counter, carrying into the nonce words */
+    for (int i = 12; i < 16 && ++chacha_state[i] == 0; i++)
+        ;
+}
 
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void kernel_randombytes(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
 
     ssize_t xlen = (ssize_t) how_much;
     assert(xlen >= 0);
-    if (fd == -1) {
+
+#if defined(__linux__)
+    while (xlen > 0) {
+        i = getrandom(x, (size_t) xlen, 0);
+        if (i < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Kernel too old for getrandom; use the device instead */
+            break;
+        }
+        x += i;
+        xlen -= i;
+    }
+#endif
+
+    if (xlen > 0 && fd == -1) {
         for (;;) {
             fd = open("/dev/urandom", O_RDONLY);
             if (fd != -1)
@@ -37,3 +118,63 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+static void rekey(void)
+{
+    /* "expand 32-byte k" */
+    chacha_state[0] = 0x61707865;
+    chacha_state[1] = 0x3320646e;
+    chacha_state[2] = 0x79622d32;
+    chacha_state[3] = 0x6b206574;
+    /* 256-bit key followed by the initial counter and nonce */
+    kernel_randombytes((uint8_t *) &chacha_state[4], 12 * sizeof(uint32_t));
+
+    buf_left = 0;
+    bits_left = 0;
+    keyed = true;
+}
+
+static void refill(void)
+{
+    for (int i = 0; i < BUF_BLOCKS; i++)
+        chacha_block(buf + i * CHACHA_BLOCK);
+    buf_left = sizeof(buf);
+}
+
+void randombytes_reseed(void)
+{
+    rekey();
+}
+
+void randombytes(uint8_t *x, size_t how_much)
+{
+    if (!keyed)
+        rekey();
+
+    while (how_much > 0) {
+        if (buf_left == 0)
+            refill();
+
+        size_t n = how_much < buf_left ? how_much : buf_left;
+        uint8_t *src = buf + sizeof(buf) - buf_left;
+        memcpy(x, src, n);
+        /* Never hand out the same bytes twice */
+        memset(src, 0, n);
+        buf_left -= n;
+        x += n;
+        how_much -= n;
+    }
+}
+
+uint8_t randombit(void)
+{
+    if (bits_left == 0) {
+        randombytes((uint8_t *) &bit_cache, sizeof(bit_cache));
+        bits_left = 64;
+    }
+
+    uint8_t ret = bit_cache & 1;
+    bit_cache >>= 1;
+    bits_left--;
+    return ret;
+}
@@ -4,13 +4,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Fill x with xlen unpredictable bytes.
+ * Served from a ChaCha20 keystream buffered in userspace, keyed from the
+ * kernel once, so most calls make no system call.
+ */
 void randombytes(uint8_t *x, size_t xlen);
 
-static inline uint8_t randombit(void)
-{
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
-}
+/* Return one random bit, taken from a cached word */
+uint8_t randombit(void);
+
+/*
+ * Discard the current key and buffered output and rekey from the kernel.
+ * Must be called in a child process after fork(), which would otherwise
+ * repeat the parent's stream.
+ */
+void randombytes_reseed(void);
 
 #endif
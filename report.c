@@ -8,7 +8,11 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
@@ -31,6 +35,7 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
         fputs(fail_buf, logfile);
@@ -47,9 +52,19 @@ void set_verblevel(int level)
 bool set_logfile(char *file_name)
 {
     logfile = fopen(file_name, "w");
+    if (logfile)
+        setvbuf(logfile, NULL, _IOFBF, REPORT_BUFSIZE);
     return logfile != NULL;
 }
 
+void report_flush()
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (logfile)
+        fflush(logfile);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -64,6 +79,8 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    /* Keep the error after the output it follows */
+    report_flush();
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
@@ -79,6 +96,7 @@ void report_event(message_t msg, char *fmt, ...)
         fflush(logfile);
         va_end(ap);
         fclose(logfile);
+        logfile = NULL;
     }
 
     if (fatal) {
@@ -88,47 +106,44 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
+/* Messages are buffered until report_flush, see report.h */
 void report(int level, char *fmt, ...)
 {
+    if (level > verblevel)
+        return;
     if (!verbfile)
         init_files(stdout, stdout);
 
-    if (level <= verblevel) {
-        va_list ap;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(verbfile, fmt, ap);
+    putc('\n', verbfile);
+    va_end(ap);
+
+    if (logfile) {
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
+        vfprintf(logfile, fmt, ap);
+        putc('\n', logfile);
         va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
     }
 }
 
 void report_noreturn(int level, char *fmt, ...)
 {
+    if (level > verblevel)
+        return;
     if (!verbfile)
         init_files(stdout, stdout);
 
-    if (level <= verblevel) {
-        va_list ap;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(verbfile, fmt, ap);
+    va_end(ap);
+
+    if (logfile) {
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
+        vfprintf(logfile, fmt, ap);
         va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
     }
 }
 
@@ -137,6 +152,7 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(char *format, char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -151,8 +167,10 @@ static void fail_fun(char *format, char *msg)
     if (fatal_fun)
         fatal_fun();
 
-    if (logfile)
+    if (logfile) {
         fclose(logfile);
+        logfile = NULL;
+    }
 
     exit(1);
 }
@@ -272,6 +290,75 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+/* Time spent busy waiting to find the rate of the cycle counter */
+#define TSC_CALIBRATION_NS 20000000
+
+/* Use the cycle counter instead of the clock, scaled by tsc_mult / 2^32
+ * nanoseconds per tick from the readings at tsc_base and tsc_base_ns
+ */
+static bool tsc_time = false;
+static uint64_t tsc_base, tsc_base_ns, tsc_mult;
+
+static uint64_t clock_ns()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether the cycle counter ticks at a constant rate, even in sleep states */
+static bool tsc_invariant()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return edx & (1 << 8);
+#else
+    /* The Arm generic timer has a fixed frequency */
+    return true;
+#endif
+}
+
+bool set_tsc_time(bool on)
+{
+    tsc_time = false;
+    if (!on)
+        return true;
+    if (!tsc_invariant()) {
+        report(1, "The cycle counter rate is not constant on this machine");
+        return false;
+    }
+
+    uint64_t start_ns = clock_ns(), start = cpucycles();
+    uint64_t end_ns;
+    do
+        end_ns = clock_ns();
+    while (end_ns - start_ns < TSC_CALIBRATION_NS);
+    uint64_t end = cpucycles();
+    if (end <= start)
+        return false;
+
+    tsc_mult = ((end_ns - start_ns) << 32) / (end - start);
+    tsc_base = end;
+    tsc_base_ns = end_ns;
+    tsc_time = true;
+    return true;
+}
+
+uint64_t time_ns()
+{
+    if (!tsc_time)
+        return clock_ns();
+    uint64_t ticks = cpucycles() - tsc_base;
+    return tsc_base_ns + (uint64_t) (((unsigned __int128) ticks * tsc_mult) >>
+                                     32);
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -280,10 +367,21 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
+}
+
+void init_time_ns(uint64_t *timep)
+{
+    *timep = time_ns();
+}
+
+uint64_t delta_time_ns(uint64_t *timep)
+{
+    uint64_t current_time = time_ns();
+    uint64_t delta = current_time - *timep;
+    *timep = current_time;
+    return delta;
 }
\ No newline at end of file
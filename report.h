@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -25,12 +26,23 @@ void set_verblevel(int level);
 /* Error messages */
 void report_event(message_t msg, char *fmt, ...);
 
-/* Report useful information */
+/* Size of the log file buffer */
+#define REPORT_BUFSIZE (64 * 1024)
+
+/* Report useful information.  Messages above the verbosity level are
+ * dropped before formatting.  Others are buffered, and only written out by
+ * report_flush, or before an error or fatal message.
+ */
 void report(int verblevel, char *fmt, ...);
 
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Write out buffered messages.  The console calls this after every command
+ * and at exit.
+ */
+void report_flush();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -58,4 +70,17 @@ void init_time(double *timep);
    and reset timer */
 double delta_time(double *timep);
 
+/* Same, counted as integer nanoseconds */
+void init_time_ns(uint64_t *timep);
+uint64_t delta_time_ns(uint64_t *timep);
+
+/* Nanoseconds on a monotonic clock unaffected by time adjustments */
+uint64_t time_ns();
+
+/* Read time from the cycle counter, which is faster than the clock, after
+ * calibrating its rate against the clock.  Return false if the counter
+ * cannot be used; the clock is used then.
+ */
+bool set_tsc_time(bool on);
+
 #endif /* LAB0_REPORT_H */
@@ -1,9 +1,11 @@
 #!/usr/bin/env python3
 
 from __future__ import print_function
+import os
 import subprocess
 import sys
 import getopt
+import tempfile
 
 
 
@@ -35,7 +37,14 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-threads",
+        19: "trace-19-budget",
+        20: "trace-20-seed",
+        21: "trace-21-compiled",
+        22: "trace-22-repeat",
+        23: "trace-23-stats",
+        24: "trace-24-epoll"
     }
 
     traceProbs = {
@@ -55,10 +64,23 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces also compiled, whose replay must print the same as the text
+    compiledTraces = [21]
+
+    # Traces that need the epoll event loop
+    epollTraces = [24]
+
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 5, 5, 5, 5, 5, 5, 5]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -89,6 +111,11 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if tid in self.epollTraces:
+            clist = self.command + ["-v", vname, "--epoll", "-f", fname]
+
+        if tid in self.compiledTraces:
+            return self.runCompiled(fname, clist)
 
         try:
             retcode = subprocess.call(clist)
@@ -97,6 +124,30 @@ class Tracer:
             return False
         return retcode == 0
 
+    def runCompiled(self, fname, clist):
+        fd, cname = tempfile.mkstemp(suffix=".qbc")
+        os.close(fd)
+        compile_list = [self.qtest, "--compile", fname, "-o", cname]
+        replay_list = clist[:-1] + [cname]
+        try:
+            subprocess.check_output(compile_list)
+            text = subprocess.Popen(clist, stdout=subprocess.PIPE)
+            text_out = text.communicate()[0]
+            replay = subprocess.Popen(replay_list, stdout=subprocess.PIPE)
+            replay_out = replay.communicate()[0]
+        except Exception as e:
+            self.printInColor("Replay of compiled '%s' failed: %s" % (fname, e), self.RED)
+            return False
+        finally:
+            os.remove(cname)
+
+        sys.stdout.write(text_out.decode())
+        sys.stdout.flush()
+        if text_out != replay_out:
+            self.printInColor("Compiled '%s' printed differently" % fname, self.RED)
+            return False
+        return text.returncode == 0 and replay.returncode == 0
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
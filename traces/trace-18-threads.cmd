@@ -0,0 +1,14 @@
+# Test of insert_tail from several threads, with elements freed by others
+option fail 0
+option malloc 0
+new
+mt dolphin 2000 4
+size
+it gerbil
+rh dolphin
+rt gerbil
+free
+new
+mt bear 500 8
+size
+free
@@ -0,0 +1,19 @@
+# Test of allocation budgets, with failed insertions freeing their own blocks
+option fail 100
+option malloc 0
+option seed 1
+new
+ih gerbil 20
+it bear 20
+option malloc 50
+ih dolphin 40
+it meerkat 40
+option malloc 0
+size
+sort
+reverse
+rh meerkat
+rt bear
+dm
+dedup
+free
@@ -0,0 +1,21 @@
+# Test of reproducing random strings with option seed
+option fail 0
+option malloc 0
+option seed 7
+new
+it RAND 4
+option seed 7
+it RAND 4
+rh vehipgjh
+rh glndlfezc
+rh iixptlobw
+rh kaoaqkw
+rh vehipgjh
+rh glndlfezc
+rh iixptlobw
+rh kaoaqkw
+option seed 7
+ih RAND 2
+rt vehipgjh
+rt glndlfezc
+free
@@ -0,0 +1,19 @@
+# Test of replaying the compiled form of a trace, which must match the text,
+#   spacing   included
+
+option fail 0
+option malloc 0
+new
+ih gerbil 3
+it   bear
+it dolphin
+reverse
+show
+rh	dolphin
+rh bear
+rh gerbil
+rh gerbil
+size
+sort
+rt gerbil
+free
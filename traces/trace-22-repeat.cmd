@@ -0,0 +1,15 @@
+# Test of repeat on a known queue
+option fail 0
+option malloc 0
+new
+ih dolphin 3
+it bear 2
+repeat 3 rh dolphin
+size
+repeat 2 it gerbil
+repeat 0 rh bear
+repeat 2 rh bear
+repeat 2 rt gerbil
+size
+repeat 2 size
+free
@@ -0,0 +1,16 @@
+# Test of recording and showing per-command latencies
+option fail 0
+option malloc 0
+stats
+option stats 1
+new
+ih dolphin 10
+repeat 5 size
+rh dolphin
+stats
+stats reset
+stats
+it bear
+stats
+option stats 0
+free
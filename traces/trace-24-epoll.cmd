@@ -0,0 +1,5 @@
+# Test of callbacks of the epoll event loop removing ready descriptors
+pipes
+pipes 1
+pipes 16
+pipes 64